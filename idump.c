@@ -5,12 +5,10 @@
 #include "loader.h"
 #include "image.h"
 
-char temp_file[BUFSIZE];
-
 void usage()
 {
 	printf("usage:\n"
-		"\tidump [-h] [-f] [-r angle] image\n"
+		"\tidump [-h] [-f] [-r angle] [-p page] image\n"
 		"\tcat image | idump\n"
 		"\twget -O - image_url | idump\n"
 		"options:\n"
@@ -19,74 +17,128 @@ void usage()
 		"\t-r: rotate image (90/180/270)\n"
 		"\t-c: center image\n"
 		"\t-b: transparent background color (0-255)\n"
+		"\t-p: page of multi-page image (tiff) to show (1-)\n"
 		);
 }
 
-void remove_temp_file()
+struct display_t {
+	struct framebuffer_t *fb;
+	bool resize;
+	bool center;
+	uint8_t alpha_background;
+};
+
+void image_position(struct display_t *disp, struct image_t *img, int *posx, int *posy, int *shiftx, int *shifty)
 {
-	extern char temp_file[BUFSIZE]; /* global */
-	remove(temp_file);
+	struct framebuffer_t *fb = disp->fb;
+	int width  = get_full_width(img);
+	int height = get_full_height(img);
+
+	*posx = *shiftx = *posy = *shifty = 0;
+
+	/* center image */
+	if (disp->center) {
+		if (fb->info.width - width < 0) {
+			*shiftx = -(fb->info.width - width) / 2;
+		} else {
+			*posx = (fb->info.width - width) / 2;
+		}
+		if (fb->info.height - height < 0) {
+			*shifty = -(fb->info.height - height) / 2;
+		} else {
+			*posy = (fb->info.height - height) / 2;
+		}
+	}
+
+	/* shift in decoded region */
+	*shiftx -= get_crop_x(img);
+	*shifty -= get_crop_y(img);
 }
 
-char *make_temp_file(const char *template)
+void display_image(struct display_t *disp, struct image_t *img, bool enable_anim)
 {
-	extern char temp_file[BUFSIZE]; /* global */
-	int fd;
-	ssize_t size, file_size = 0;
-	char buf[BUFSIZE], *env;
-
-	/* stdin is tty or not */
-	if (isatty(STDIN_FILENO)) {
-		logging(ERROR, "stdin is neither pipe nor redirect\n");
-		return NULL;
-	}
+	int posx, shiftx, posy, shifty;
 
-	/* prepare temp file */
-	memset(temp_file, 0, BUFSIZE);
-	if ((env = getenv("TMPDIR")) != NULL) {
-		snprintf(temp_file, BUFSIZE, "%s/%s", env, template);
-	} else {
-		snprintf(temp_file, BUFSIZE, "/tmp/%s", template);
-	}
+	image_position(disp, img, &posx, &posy, &shiftx, &shifty);
+	draw_image(disp->fb, img, posx, posy, shiftx, shifty, img->width, img->height, disp->alpha_background, enable_anim);
+}
+
+uint8_t *display_direct(struct image_t *img, int *stride, void *arg)
+{
+	/* called by loader with framebuffer pixel image (opaque, not rotated):
+		if whole image fits in screen (no resize), decoder writes into framebuffer */
+	struct display_t *disp = (struct display_t *) arg;
+	struct framebuffer_t *fb = disp->fb;
+	int posx, shiftx, posy, shifty;
 
-	if ((fd = emkstemp(temp_file)) < 0)
+	if (img->width > fb->info.width || img->height > fb->info.height)
 		return NULL;
-	logging(DEBUG, "tmp file:%s\n", temp_file);
 
-	/* register cleanup function */
-	if (atexit(remove_temp_file))
-		logging(ERROR, "atexit() failed\nmaybe temporary file remains...\n");
+	image_position(disp, img, &posx, &posy, &shiftx, &shifty);
+	if (shiftx != 0 || shifty != 0)
+		return NULL;
+	*stride = fb->info.line_length;
 
-	/* read data */
-	while ((size = read(STDIN_FILENO, buf, BUFSIZE)) > 0) {
-		if (write(fd, buf, size) != size)
-			logging(ERROR, "write error\n");
-		file_size += size;
-	}
-	eclose(fd);
+	return fb->fp + posy * fb->info.line_length + posx * fb->info.bytes_per_pixel;
+}
 
-	if (file_size == 0) {
-		logging(ERROR, "stdin is empty\n");
-		return NULL;
+void display_progress(struct image_t *img, void *arg)
+{
+	/* called by loader with partially decoded image:
+		decoder still writes frame data of img, so resize a copy of it */
+	struct display_t *disp = (struct display_t *) arg;
+	struct image_t partial = *img;
+	struct frame_t frame = img->frames[0];
+	size_t size;
+
+	partial.frames = &frame;
+	if (disp->resize) {
+		size = (size_t) img->width * img->height * img->channel;
+		if ((frame.data = (uint8_t *) ecalloc(1, size)) == NULL)
+			return;
+		memcpy(frame.data, img->frames[0].data, size);
+		resize_image(&partial, disp->fb->info.width, disp->fb->info.height, false);
 	}
 
-	return temp_file;
+	display_image(disp, &partial, false);
+
+	if (disp->resize)
+		free(frame.data);
+}
+
+bool display_crop(struct image_t *img, int *x, int *y, int *width, int *height, void *arg)
+{
+	/* called by loader with whole image size (not rotated/resized):
+		image larger than screen is only partially visible */
+	struct display_t *disp = (struct display_t *) arg;
+	struct framebuffer_t *fb = disp->fb;
+	int posx, posy;
+
+	if (img->width <= fb->info.width && img->height <= fb->info.height)
+		return false;
+
+	image_position(disp, img, &posx, &posy, x, y);
+	*width  = fb->info.width - posx;
+	*height = fb->info.height - posy;
+
+	return true;
 }
 
 int main(int argc, char **argv)
 {
-	const char *template = "sdump.XXXXXX";
 	char *file;
 	bool resize = false;
 	bool center = false;
 	bool blank = false;
-	int angle = 0, opt;
+	int angle = 0, page = 1, opt;
 	uint8_t alpha_background = ALPHA_BACKGROUND;
 	struct framebuffer_t fb;
 	struct image_t img;
+	struct display_t disp;
+	struct load_hint_t hint = {0, 0, NULL, NULL, LAYOUT_RGB, NULL, NULL, NULL, NULL};
 
 	/* check arg */
-	while ((opt = getopt(argc, argv, "hcfr:b:")) != -1) {
+	while ((opt = getopt(argc, argv, "hcfr:b:p:")) != -1) {
 		switch (opt) {
 		case 'h':
 			usage();
@@ -103,19 +155,19 @@ int main(int argc, char **argv)
 		case 'b':
 			alpha_background = str2num(optarg);
 			break;
+		case 'p':
+			page = str2num(optarg);
+			break;
 		default:
 			break;
 		}
 	}
 
-	/* open file */
-	if (optind < argc)
-		file = argv[optind];
-	else
-		file = make_temp_file(template);
+	/* open file: NULL means reading image from stdin */
+	file = (optind < argc) ? argv[optind]: NULL;
 
-	if (file == NULL) {
-		logging(FATAL, "input file not found\n");
+	if (file == NULL && isatty(STDIN_FILENO)) {
+		logging(FATAL, "stdin is neither pipe nor redirect\n");
 		usage();
 		return EXIT_FAILURE;
 	}
@@ -126,41 +178,60 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	if (!load_image(file, &img)) {
+	disp.fb               = &fb;
+	disp.resize           = resize;
+	disp.center           = center;
+	disp.alpha_background = alpha_background;
+
+	/* let decoder shrink image while loading (image is rotated before resize) */
+	if (resize) {
+		hint.max_width  = fb.info.width;
+		hint.max_height = fb.info.height;
+		if (angle == 90 || angle == 270)
+			swapint(&hint.max_width, &hint.max_height);
+	}
+
+	/* let decoder write framebuffer pixel (packed 16bpp pixel can't be resized) */
+	hint.layout = get_pixel_layout(&fb.info);
+	if (resize && hint.layout == LAYOUT_RGB565)
+		hint.layout = LAYOUT_RGB;
+
+	/* draw partial image while reading pipe,
+		or decode straight into framebuffer (not rotated until loaded) */
+	if (angle == 0) {
+		hint.progress     = display_progress;
+		hint.progress_arg = &disp;
+		hint.direct       = display_direct;
+		hint.direct_arg   = &disp;
+	}
+
+	/* decode only visible region of large image (not rotated/resized) */
+	if (angle == 0 && !resize) {
+		hint.crop     = display_crop;
+		hint.crop_arg = &disp;
+	}
+
+	if (!load_image(file, &img, &hint)) {
 		logging(FATAL, "couldn't load image\n");
 		fb_die(&fb);
 		return EXIT_FAILURE;
 	}
 
-	/* rotate/resize and draw */
+	/* rotate/resize and draw (already drawn by decoder: nothing to do)
+		only the shown page of document is decoded and processed */
 	/* TODO: support color reduction for 8bpp mode */
-	if (angle != 0)
-		rotate_image(&img, angle, true);
+	if (!img.drawn) {
+		set_current_frame(&img, page - 1);
 
-	
-	if (resize)
-		resize_image(&img, fb.info.width, fb.info.height, true);
+		if (angle != 0)
+			rotate_image(&img, angle, !is_paged(&img));
 
-	/* center image */
-	if (center) {
-		int posx = 0;
-		int shiftx = 0;
-		int posy = 0;
-		int shifty = 0;
-		if (fb.info.width - img.width < 0) {
-			shiftx = -(fb.info.width - img.width) / 2;
-		} else {
-			posx = (fb.info.width - img.width) / 2;
-		}
-		if (fb.info.height - img.height < 0) {
-			shifty = -(fb.info.height - img.height) / 2;
-		} else {
-			posy = (fb.info.height - img.height) / 2;
-		}
-		draw_image(&fb, &img, posx, posy, shiftx, shifty, img.width, img.height, alpha_background, true);
-	} else {
-		draw_image(&fb, &img, 0, 0, 0, 0, img.width, img.height, alpha_background, true);
+		if (resize)
+			resize_image(&img, fb.info.width, fb.info.height, !is_paged(&img));
+
+		display_image(&disp, &img, true);
 	}
+
 	/* cleanup resource */
 	free_image(&img);
 	fb_die(&fb);
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 //#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -8,19 +8,330 @@ static inline int get_frame_count(struct image_t *img)
 	return img->frame_count;
 }
 
+uint8_t *rotate_image_single(struct image_t *img, uint8_t *data, int angle);
+uint8_t *resize_image_single(struct image_t *img, uint8_t *data, int disp_width, int disp_height);
+
+/* NULL: no memory (data is freed) */
+static inline uint8_t *rotate_page(struct image_t *img, struct image_t *page, uint8_t *data)
+{
+	uint8_t *rotated;
+
+	if (img->page_angle == 0)
+		return data;
+	if ((rotated = rotate_image_single(page, data, img->page_angle)) == NULL)
+		free(data);
+	return rotated;
+}
+
+static inline uint8_t *resize_page(struct image_t *img, struct image_t *page, uint8_t *data)
+{
+	uint8_t *resized;
+
+	if (img->page_max_width == 0
+		|| (page->width <= img->page_max_width && page->height <= img->page_max_height))
+		return data;
+	if ((resized = resize_image_single(page, data, img->page_max_width, img->page_max_height)) == NULL)
+		free(data);
+	return resized;
+}
+
+/* page decoded after the current page was rotated/resized: do the same to it
+	in the same order (see record_page_transform()) */
+static inline bool transform_page(struct image_t *img, int index)
+{
+	struct image_t page = *img;
+	uint8_t *data = img->frames[index].data;
+
+	if (!img->paged || img->page_width == 0)
+		return true;
+
+	page.width  = img->page_width;
+	page.height = img->page_height;
+	if (img->page_resized_first)
+		data = resize_page(img, &page, data);
+	if (data)
+		data = rotate_page(img, &page, data);
+	if (data && !img->page_resized_first)
+		data = resize_page(img, &page, data);
+
+	/* frames share size */
+	if (data && (page.width != img->width || page.height != img->height)) {
+		logging(ERROR, "page %d: %dx%d doesn't match image %dx%d\n",
+			index, page.width, page.height, img->width, img->height);
+		free(data);
+		data = NULL;
+	}
+	img->frames[index].data = data;
+
+	return (data != NULL);
+}
+
+/* frame is decoded on first access if loader decodes lazily (e.g. pages of tiff):
+	only the last img->max_cached frames are kept (playback goes forward) */
+static inline uint8_t *get_frame_data(struct image_t *img, int index)
+{
+	if (index < 0 || index >= img->frame_count)
+		return NULL;
+
+	if (img->frames[index].data || img->decode_frame == NULL)
+		return img->frames[index].data;
+
+	if (!img->decode_frame(img, index) || !transform_page(img, index)) {
+		logging(ERROR, "couldn't decode frame:%d\n", index);
+		return NULL;
+	}
+
+	for (int i = 0; img->max_cached > 0 && i < img->frame_count; i++) {
+		if ((index - i + img->frame_count) % img->frame_count >= img->max_cached) {
+			free(img->frames[i].data);
+			free(img->frames[i].palette);
+			img->frames[i].data = NULL;
+			img->frames[i].palette = NULL;
+		}
+	}
+	return img->frames[index].data;
+}
+
+/* rectangle of frame updated from the previous frame (whole image if frames are not deltas) */
+static inline struct rect_t get_frame_rect(struct image_t *img, int index)
+{
+	struct rect_t whole = {0, 0, img->width, img->height};
+
+	return (img->delta && index > 0) ? img->frames[index].rect: whole;
+}
+
+/* whole frame: update rectangles of delta frames are composited into img->canvas
+	(valid until next call) */
+static inline uint8_t *get_frame(struct image_t *img, int index)
+{
+	uint8_t *data, *dst, *palette;
+	struct rect_t rect;
+	size_t stride = (size_t) img->width * img->channel;
+
+	if (!img->delta)
+		return get_frame_data(img, index);
+
+	if (img->canvas == NULL) {
+		if ((img->canvas = (uint8_t *) ecalloc(img->height, stride)) == NULL)
+			return NULL;
+		img->canvas_frame = -1;
+	}
+
+	/* go forward from composited frame, or start again from the first frame */
+	if (img->canvas_frame > index)
+		img->canvas_frame = -1;
+
+	while (img->canvas_frame < index) {
+		if ((data = get_frame_data(img, img->canvas_frame + 1)) == NULL) {
+			img->canvas_frame = -1;
+			return NULL;
+		}
+		img->canvas_frame++;
+
+		rect    = get_frame_rect(img, img->canvas_frame);
+		palette = img->frames[img->canvas_frame].palette;
+		for (int y = 0; y < rect.height; y++) {
+			dst = img->canvas + (rect.y + y) * stride + rect.x * img->channel;
+			if (palette) {
+				for (int x = 0; x < rect.width; x++, dst += img->channel)
+					memcpy(dst, palette + *data++ * img->channel, img->channel);
+			} else {
+				memcpy(dst, data, (size_t) rect.width * img->channel);
+				data += rect.width * img->channel;
+			}
+		}
+	}
+	return img->canvas;
+}
+
+/* drop frames from index which can't be composited (the first frame is always kept) */
+static inline void drop_frames(struct image_t *img, int index)
+{
+	for (int j = (index > 0) ? index: 1; j < img->frame_count; j++) {
+		free(img->frames[j].data);
+		free(img->frames[j].palette);
+		img->frames[j].data = NULL;
+		img->frames[j].palette = NULL;
+	}
+	img->frame_count = (index > 0) ? index: 1;
+}
+
+/* frames will be modified (can't be decoded again): keep all of them as whole frames
+	(a frame same as the previous one shares its data: still parts of animation cost nothing) */
+static inline void keep_frames(struct image_t *img)
+{
+	uint8_t *data = NULL;
+	size_t size = (size_t) img->width * img->height * img->channel;
+	bool shared;
+
+	img->max_cached = 0;
+	if (!img->delta)
+		return;
+
+	for (int i = 0; i < img->frame_count; i++) {
+		shared = false;
+		if (get_frame(img, i) == NULL
+			|| (!(shared = (i > 0 && memcmp(img->frames[i - 1].data, img->canvas, size) == 0))
+			&& (data = (uint8_t *) ecalloc(1, size)) == NULL)) {
+			drop_frames(img, i);
+			break;
+		}
+		if (shared)
+			data = img->frames[i - 1].data;
+		else
+			memcpy(data, img->canvas, size);
+		/* frame data is not needed after composited (next frame is composited from canvas) */
+		free(img->frames[i].data);
+		free(img->frames[i].palette);
+		img->frames[i].data    = data;
+		img->frames[i].palette = NULL;
+		img->frames[i].shared  = shared;
+	}
+	free(img->canvas);
+	img->canvas = NULL;
+	img->delta  = false;
+}
+
+/* keep_frames() for resizing all frames: each frame is shrunk as soon as composited,
+	so only the canvas is kept at full size (false: frames are not deltas or can't be shrunk) */
+static inline bool keep_shrunk_frames(struct image_t *img, int max_width, int max_height)
+{
+	struct shrink_t shrink;
+	struct rect_t rect;
+	uint8_t *last, *src, *dst;
+	size_t stride = (size_t) img->width * img->channel;
+	bool shared;
+	int i, width, height;
+
+	if (!img->delta || get_frame(img, 0) == NULL
+		|| !shrink_init(&shrink, img->width, img->height, img->channel, max_width, max_height))
+		return false;
+	width  = shrink.dst_width;
+	height = shrink.dst_height;
+
+	/* copy of the last canvas: frame which updates nothing shares the previous frame */
+	if ((last = (uint8_t *) ecalloc(img->height, stride)) != NULL)
+		memcpy(last, img->canvas, img->height * stride);
+	img->max_cached = 0;
+
+	for (i = 0; i < img->frame_count; i++) {
+		if (i > 0 && get_frame(img, i) == NULL)
+			break;
+
+		shared = (i > 0 && last != NULL);
+		rect   = get_frame_rect(img, i);
+		for (int y = 0; shared && y < rect.height; y++) {
+			src = img->canvas + (rect.y + y) * stride + rect.x * img->channel;
+			dst = last + (rect.y + y) * stride + rect.x * img->channel;
+			shared = (memcmp(dst, src, (size_t) rect.width * img->channel) == 0);
+			if (!shared)
+				for (int j = y; j < rect.height; j++, src += stride, dst += stride)
+					memcpy(dst, src, (size_t) rect.width * img->channel);
+		}
+
+		free(img->frames[i].data);
+		free(img->frames[i].palette);
+		img->frames[i].palette = NULL;
+		img->frames[i].shared  = shared;
+		if (shared) {
+			img->frames[i].data = img->frames[i - 1].data;
+			continue;
+		}
+
+		if (i > 0 && !shrink_init(&shrink, img->width, img->height, img->channel, max_width, max_height)) {
+			img->frames[i].data = NULL;
+			break;
+		}
+		for (int y = 0; y < img->height; y++)
+			shrink_row(&shrink, img->canvas + y * stride);
+		shrink_die(&shrink);
+		img->frames[i].data = shrink.data;
+	}
+	drop_frames(img, i);
+
+	free(last);
+	free(img->canvas);
+	img->canvas = NULL;
+	img->delta  = false;
+	img->width  = width;
+	img->height = height;
+
+	return true;
+}
+
+/* only one frame will be modified: frames sharing data get their own copy (copy on write) */
+static inline void unshare_frames(struct image_t *img)
+{
+	uint8_t *data;
+	size_t size = (size_t) img->width * img->height * img->channel;
+
+	for (int i = 0; i < img->frame_count; i++) {
+		if (!img->frames[i].shared || (data = (uint8_t *) ecalloc(1, size)) == NULL)
+			continue;
+		memcpy(data, img->frames[i].data, size);
+		img->frames[i].data   = data;
+		img->frames[i].shared = false;
+	}
+}
+
+/* only the current page of document was rotated (angle) or resized (max_width x max_height)
+	from width x height: other pages are decoded again and get the same (see transform_page()) */
+static inline void record_page_transform(struct image_t *img, int width, int height,
+	int angle, int max_width, int max_height)
+{
+	if (!img->paged || img->decode_frame == NULL)
+		return;
+
+	if (img->page_width == 0) {
+		img->page_width  = width;
+		img->page_height = height;
+	}
+	if (angle != 0) {
+		img->page_angle = (img->page_angle + angle) % 360;
+		if (img->page_max_width > 0)
+			img->page_resized_first = true;
+	}
+	if (max_width > 0) {
+		img->page_max_width  = max_width;
+		img->page_max_height = max_height;
+	}
+
+	for (int i = 0; i < img->frame_count; i++) {
+		if (i == img->current_frame)
+			continue;
+		free(img->frames[i].data);
+		free(img->frames[i].palette);
+		img->frames[i].data    = NULL;
+		img->frames[i].palette = NULL;
+	}
+}
+
 static inline uint8_t *get_current_frame(struct image_t *img)
 {
-	return img->data[img->current_frame];
+	return get_frame(img, img->current_frame);
 }
 
 static inline int get_current_delay(struct image_t *img)
 {
-	return img->delay[img->current_frame];
+	return img->frames[img->current_frame].delay;
 }
 
 static inline void increment_frame(struct image_t *img)
 {
-	img->current_frame = (img->current_frame + 1) % img->frame_count;
+	if (img->frame_count > 0)
+		img->current_frame = (img->current_frame + 1) % img->frame_count;
+}
+
+static inline void set_current_frame(struct image_t *img, int index)
+{
+	if (0 <= index && index < img->frame_count)
+		img->current_frame = index;
+}
+
+/* frames are pages of document: shown one by one, not played as animation */
+static inline bool is_paged(struct image_t *img)
+{
+	return img->paged;
 }
 
 static inline int get_image_width(struct image_t *img)
@@ -33,6 +344,27 @@ static inline int get_image_height(struct image_t *img)
 	return img->height;
 }
 
+/* data may be only a region of whole image (see load_hint_t crop) */
+static inline int get_full_width(struct image_t *img)
+{
+	return (img->full_width) ? img->full_width: img->width;
+}
+
+static inline int get_full_height(struct image_t *img)
+{
+	return (img->full_height) ? img->full_height: img->height;
+}
+
+static inline int get_crop_x(struct image_t *img)
+{
+	return img->crop_x;
+}
+
+static inline int get_crop_y(struct image_t *img)
+{
+	return img->crop_y;
+}
+
 static inline int get_image_channel(struct image_t *img)
 {
 	return img->channel;
@@ -55,33 +387,43 @@ static inline void get_rgb(struct image_t *img, uint8_t *data, int x, int y, uin
 	}
 }
 
-static inline void get_average(struct image_t *img, uint8_t *data, int x_from, int y_from, int x_to, int y_to, uint8_t pixel[])
+/* framebuffer pixel layout which decoders can write directly */
+enum pixel_layout_t get_pixel_layout(struct fb_info_t *info)
 {
-	int cell_num;
-	uint8_t r, g, b;
-	uint16_t rsum, gsum, bsum;
-
-	rsum = gsum = bsum = 0;
-	for (int y = y_from; y < y_to; y++) {
-		for (int x = x_from; x < x_to; x++) {
-			get_rgb(img, data, x, y, &r, &g, &b, NULL);
-			rsum += r; gsum += g; bsum += b;
-		}
+	uint16_t endian = 1;
+	int r, g, b;
+
+	if (info->visual != YAFT_FB_VISUAL_TRUECOLOR)
+		return LAYOUT_RGB;
+
+	if (info->bits_per_pixel == 16
+		&& info->red.length   == 5 && info->red.offset   == 11
+		&& info->green.length == 6 && info->green.offset == 5
+		&& info->blue.length  == 5 && info->blue.offset  == 0)
+		return LAYOUT_RGB565;
+
+	if (info->bits_per_pixel != 32
+		|| info->red.length != 8 || info->green.length != 8 || info->blue.length != 8)
+		return LAYOUT_RGB;
+
+	/* byte position of each color in memory */
+	r = info->red.offset / 8;
+	g = info->green.offset / 8;
+	b = info->blue.offset / 8;
+	if (*(uint8_t *) &endian == 0) { /* big endian */
+		r = 3 - r; g = 3 - g; b = 3 - b;
 	}
 
-	cell_num = (y_to - y_from) * (x_to - x_from);
-	if (cell_num > 1) {
-		rsum /= cell_num; gsum /= cell_num; bsum /= cell_num;
-	}
-
-	if (img->channel <= 2)
-		*pixel++ = rsum;
-	else {
-		*pixel++ = rsum; *pixel++ = gsum; *pixel++ = bsum;
-	}
+	if (r == 2 && g == 1 && b == 0)
+		return LAYOUT_BGRX;
+	else if (r == 0 && g == 1 && b == 2)
+		return LAYOUT_RGBX;
+	else if (r == 3 && g == 2 && b == 1)
+		return LAYOUT_XBGR;
+	else if (r == 1 && g == 2 && b == 3)
+		return LAYOUT_XRGB;
 
-	if (img->alpha)
-		*pixel = 0;
+	return LAYOUT_RGB;
 }
 
 /* some image proccessing functions:
@@ -142,77 +484,93 @@ uint8_t *rotate_image_single(struct image_t *img, uint8_t *data, int angle)
 
 void rotate_image(struct image_t *img, int angle, bool rotate_all)
 {
-	uint8_t *rotated_data;
+	uint8_t *data, *rotated_data;
+	int width = img->width, height = img->height;
+
+	keep_frames(img);
 
 	if (rotate_all) {
-		for (int i = 0; i < img->frame_count; i++)
-			if ((rotated_data = rotate_image_single(img, img->data[i], angle)) != NULL)
-				img->data[i] = rotated_data;
+		/* every frame is rotated from the original size */
+		for (int i = 0; i < img->frame_count; i++) {
+			if (img->frames[i].shared) {
+				img->frames[i].data = img->frames[i - 1].data;
+				continue;
+			}
+			img->width  = width;
+			img->height = height;
+			if ((data = get_frame(img, i)) != NULL
+				&& (rotated_data = rotate_image_single(img, data, angle)) != NULL)
+				img->frames[i].data = rotated_data;
+		}
 	} else {
-		if ((rotated_data = rotate_image_single(img, img->data[img->current_frame], angle)) != NULL)
-			img->data[img->current_frame] = rotated_data;
+		unshare_frames(img);
+		if ((data = get_current_frame(img)) != NULL
+			&& (rotated_data = rotate_image_single(img, data, angle)) != NULL) {
+			img->frames[img->current_frame].data = rotated_data;
+			record_page_transform(img, width, height, angle, 0, 0);
+		}
 	}
 }
 
 uint8_t *resize_image_single(struct image_t *img, uint8_t *data, int disp_width, int disp_height)
 {
 	/* TODO: support enlarge */
-	int width_rate, height_rate, resize_rate;
-	int dst_width, dst_height, y_from, x_from, y_to, x_to;
-	uint8_t *resized_data, pixel[img->channel];
-	long offset_dst;
-
-	width_rate  = MULTIPLER * disp_width  / img->width;
-	height_rate = MULTIPLER * disp_height / img->height;
-	resize_rate = (width_rate < height_rate) ? width_rate: height_rate;
+	struct shrink_t shrink;
+	size_t row_stride = (size_t) img->width * img->channel;
 
-	logging(DEBUG, "width_rate:%.2d height_rate:%.2d resize_rate:%.2d\n",
-		width_rate, height_rate, resize_rate);
-
-	/* only support shrink */
-	if ((resize_rate / MULTIPLER) >= 1)
+	/* box filter can't average packed 16bpp pixel */
+	if (img->layout == LAYOUT_RGB565)
 		return NULL;
 
-	/* FIXME: let the same num (img->width == fb->info.width), if it causes SEGV, remove "+ 1" */
-	dst_width  = resize_rate * img->width / MULTIPLER + 1;
-	dst_height = resize_rate * img->height / MULTIPLER;
-
-	if ((resized_data = (uint8_t *) ecalloc(dst_width * dst_height, img->channel)) == NULL)
+	if (!shrink_init(&shrink, img->width, img->height, img->channel, disp_width, disp_height))
 		return NULL;
 
-	logging(DEBUG, "resized image: %dx%d size:%d\n",
-		dst_width, dst_height, dst_width * dst_height * img->channel);
-
-	for (int y = 0; y < dst_height; y++) {
-		y_from = MULTIPLER * y / resize_rate;
-		y_to   = MULTIPLER * (y + 1) / resize_rate;
-		for (int x = 0; x < dst_width; x++) {
-			x_from = MULTIPLER * x / resize_rate;
-			x_to   = MULTIPLER * (x + 1) / resize_rate;
-			get_average(img, data, x_from, y_from, x_to, y_to, pixel);
-			offset_dst = img->channel * (y * dst_width + x);
-			memcpy(resized_data + offset_dst, pixel, img->channel);
-		}
-	}
+	for (int y = 0; y < img->height; y++)
+		shrink_row(&shrink, data + y * row_stride);
+	shrink_die(&shrink);
 	free(data);
 
-	img->width  = dst_width;
-	img->height = dst_height;
+	img->width  = shrink.dst_width;
+	img->height = shrink.dst_height;
 
-	return resized_data;
+	return shrink.data;
 }
 
 void resize_image(struct image_t *img, int disp_width, int disp_height, bool resize_all)
 {
-	uint8_t *resized_data;
+	uint8_t *data, *resized_data;
+	int width = img->width, height = img->height;
+
+	/* nothing to shrink: frames are left as they are (not decoded) */
+	if ((width <= disp_width && height <= disp_height) || img->layout == LAYOUT_RGB565)
+		return;
+
+	/* animation: full size frames are never kept at once */
+	if (resize_all && keep_shrunk_frames(img, disp_width, disp_height))
+		return;
+
+	keep_frames(img);
 
 	if (resize_all) {
-		for (int i = 0; i < img->frame_count; i++)
-			if ((resized_data = resize_image_single(img, img->data[i], disp_width, disp_height)) != NULL)
-				img->data[i] = resized_data;
+		/* every frame is resized from the original size */
+		for (int i = 0; i < img->frame_count; i++) {
+			if (img->frames[i].shared) {
+				img->frames[i].data = img->frames[i - 1].data;
+				continue;
+			}
+			img->width  = width;
+			img->height = height;
+			if ((data = get_frame(img, i)) != NULL
+				&& (resized_data = resize_image_single(img, data, disp_width, disp_height)) != NULL)
+				img->frames[i].data = resized_data;
+		}
 	} else {
-		if ((resized_data = resize_image_single(img, img->data[img->current_frame], disp_width, disp_height)) != NULL)
-			img->data[img->current_frame] = resized_data;
+		unshare_frames(img);
+		if ((data = get_current_frame(img)) != NULL
+			&& (resized_data = resize_image_single(img, data, disp_width, disp_height)) != NULL) {
+			img->frames[img->current_frame].data = resized_data;
+			record_page_transform(img, width, height, 0, disp_width, disp_height);
+		}
 	}
 }
 
@@ -248,19 +606,27 @@ uint8_t *normalize_bpp_single(struct image_t *img, uint8_t *data, int bytes_per_
 
 void normalize_bpp(struct image_t *img, int bytes_per_pixel, bool normalize_all)
 {
-	uint8_t *normalized_data;
+	uint8_t *data, *normalized_data;
 
 	/* XXX: now only support bytes_per_pixel == 3 */
-	if (bytes_per_pixel != 3)
+	if (bytes_per_pixel != 3 || img->layout != LAYOUT_RGB)
 		return;
 
+	keep_frames(img);
+
 	if (normalize_all) {
-		for (int i = 0; i < img->frame_count; i++)
-			if ((normalized_data = normalize_bpp_single(img, img->data[i], bytes_per_pixel)) != NULL)
-				img->data[i] = normalized_data;
+		for (int i = 0; i < img->frame_count; i++) {
+			if (img->frames[i].shared)
+				img->frames[i].data = img->frames[i - 1].data;
+			else if ((data = get_frame(img, i)) != NULL
+				&& (normalized_data = normalize_bpp_single(img, data, bytes_per_pixel)) != NULL)
+				img->frames[i].data = normalized_data;
+		}
 	} else {
-		if ((normalized_data = normalize_bpp_single(img, img->data[img->current_frame], bytes_per_pixel)) != NULL)
-			img->data[img->current_frame] = normalized_data;
+		unshare_frames(img);
+		if ((data = get_current_frame(img)) != NULL
+			&& (normalized_data = normalize_bpp_single(img, data, bytes_per_pixel)) != NULL)
+			img->frames[img->current_frame].data = normalized_data;
 	}
 }
 
@@ -275,27 +641,34 @@ void draw_image_single(struct framebuffer_t *fb, struct image_t *img, uint8_t *d
 		if (y >= fb->info.height)
 			break;
 
-		for (int x = 0; x < width; x++) {
-			if (x >= fb->info.width)
-				break;
-
-			if (img->alpha) { /* alpha brend */
-				get_rgb(img, data, x + shift_x, y + shift_y, &r, &g, &b, &a);
-				//logging(WARN, "r:0x%.2X g:0x%.2X b:0x%.2X a:0x%.2X\n", r, g, b, a);
-				br = (((uint32_t) r * a) + alpha_background * (0xFF - a)) / 0xFF;
-				bg = (((uint32_t) g * a) + alpha_background * (0xFF - a)) / 0xFF;
-				bb = (((uint32_t) b * a) + alpha_background * (0xFF - a)) / 0xFF;
-				//logging(WARN, "br:0x%.2X bg:0x%.2X bb:0x%.2X\n", br, bg, bb);
-				color = (br  << 16) + (bg  << 8) + bb;
-			} else {
-				get_rgb(img, data, x + shift_x, y + shift_y, &r, &g, &b, NULL);
-				color = (r  << 16) + (g  << 8) + b;
+		if (img->layout != LAYOUT_RGB) {
+			/* image is already framebuffer pixel: copy whole row */
+			offset = (y + offset_y) * fb->info.line_length + offset_x * fb->info.bytes_per_pixel;
+			memcpy(fb->buf + offset, data + img->channel * ((size_t) (y + shift_y) * img->width + shift_x),
+				width * fb->info.bytes_per_pixel);
+		} else {
+			for (int x = 0; x < width; x++) {
+				if (x >= fb->info.width)
+					break;
+
+				if (img->alpha) { /* alpha brend */
+					get_rgb(img, data, x + shift_x, y + shift_y, &r, &g, &b, &a);
+					//logging(WARN, "r:0x%.2X g:0x%.2X b:0x%.2X a:0x%.2X\n", r, g, b, a);
+					br = (((uint32_t) r * a) + alpha_background * (0xFF - a)) / 0xFF;
+					bg = (((uint32_t) g * a) + alpha_background * (0xFF - a)) / 0xFF;
+					bb = (((uint32_t) b * a) + alpha_background * (0xFF - a)) / 0xFF;
+					//logging(WARN, "br:0x%.2X bg:0x%.2X bb:0x%.2X\n", br, bg, bb);
+					color = (br  << 16) + (bg  << 8) + bb;
+				} else {
+					get_rgb(img, data, x + shift_x, y + shift_y, &r, &g, &b, NULL);
+					color = (r  << 16) + (g  << 8) + b;
+				}
+				pixel = color2pixel(&fb->info, color);
+
+				/* update copy buffer */
+				offset = (y + offset_y) * fb->info.line_length + (x + offset_x) * fb->info.bytes_per_pixel;
+				memcpy(fb->buf + offset, &pixel, fb->info.bytes_per_pixel);
 			}
-			pixel = color2pixel(&fb->info, color);
-
-			/* update copy buffer */
-			offset = (y + offset_y) * fb->info.line_length + (x + offset_x) * fb->info.bytes_per_pixel;
-			memcpy(fb->buf + offset, &pixel, fb->info.bytes_per_pixel);
 		}
 		/* draw each scanline */
 		if (width < fb->info.width) {
@@ -306,12 +679,65 @@ void draw_image_single(struct framebuffer_t *fb, struct image_t *img, uint8_t *d
 	}
 	/* we can draw all image data at once! */
 	if (width >= fb->info.width) {
+		offset = offset_y * fb->info.line_length;
 		size = (height > fb->info.height) ? fb->info.height: height;
 		size *= fb->info.line_length;
-		memcpy(fb->fp, fb->buf, size);
+		memcpy(fb->fp + offset, fb->buf + offset, size);
+	}
+}
+
+void draw_indexed_single(struct framebuffer_t *fb, uint8_t *data, int stride, uint32_t *lut,
+	int offset_x, int offset_y, int width, int height)
+{
+	/* palette index to framebuffer pixel: only table lookup per pixel */
+	int offset, size;
+	uint8_t *dst;
+
+	for (int y = 0; y < height; y++) {
+		offset = (y + offset_y) * fb->info.line_length + offset_x * fb->info.bytes_per_pixel;
+		dst = fb->buf + offset;
+		for (int x = 0; x < width; x++, dst += fb->info.bytes_per_pixel)
+			memcpy(dst, &lut[data[x]], fb->info.bytes_per_pixel);
+		data += stride;
+
+		size = width * fb->info.bytes_per_pixel;
+		memcpy(fb->fp + offset, fb->buf + offset, size);
 	}
 }
 
+void draw_rect_single(struct framebuffer_t *fb, struct image_t *img, int index, uint8_t *data, struct rect_t rect,
+	int offset_x, int offset_y, int x, int y, int width, int height, uint8_t alpha_background)
+{
+	/* data is only rect of frame: draw its part (x, y, width, height in image) */
+	struct image_t part;
+	uint32_t lut[PALETTE_SIZE], color;
+	uint8_t r, g, b, a = 0xFF;
+
+	if (img->frames[index].palette) {
+		/* framebuffer pixel of each palette color (alpha is blended with background) */
+		part       = *img;
+		part.width = PALETTE_SIZE;
+		for (int i = 0; i < PALETTE_SIZE; i++) {
+			get_rgb(&part, img->frames[index].palette, i, 0, &r, &g, &b, &a);
+			if (img->alpha) {
+				r = (((uint32_t) r * a) + alpha_background * (0xFF - a)) / 0xFF;
+				g = (((uint32_t) g * a) + alpha_background * (0xFF - a)) / 0xFF;
+				b = (((uint32_t) b * a) + alpha_background * (0xFF - a)) / 0xFF;
+			}
+			color  = (r << 16) + (g << 8) + b;
+			lut[i] = color2pixel(&fb->info, color);
+		}
+		draw_indexed_single(fb, data + (size_t) (y - rect.y) * rect.width + (x - rect.x), rect.width, lut,
+			offset_x, offset_y, width, height);
+		return;
+	}
+
+	part        = *img;
+	part.width  = rect.width;
+	part.height = rect.height;
+	draw_image_single(fb, &part, data, offset_x, offset_y, x - rect.x, y - rect.y, width, height, alpha_background);
+}
+
 void draw_image(struct framebuffer_t *fb, struct image_t *img,
 	int offset_x, int offset_y, int shift_x, int shift_y, int width, int height,
 	uint8_t alpha_background, bool enable_anim)
@@ -341,7 +767,9 @@ void draw_image(struct framebuffer_t *fb, struct image_t *img,
 		|       <-  width ->           |
 		+------------------------------+
 	*/
-	int loop_count = 0;
+	int loop_count = 0, x_from, x_to, y_from, y_to;
+	uint8_t *data;
+	struct rect_t rect;
 
 	if (shift_x + width > img->width)
 		width = img->width - shift_x;
@@ -355,16 +783,24 @@ void draw_image(struct framebuffer_t *fb, struct image_t *img,
 	if (offset_y + height > fb->info.height)
 		height = fb->info.height - offset_y;
 
-	/* XXX: ignore img->loop_count, force 1 loop */
-	if (enable_anim) {
+	/* XXX: ignore img->loop_count, force 1 loop (pages are not played) */
+	if (enable_anim && !is_paged(img)) {
 		while (loop_count < img->frame_count) {
-			draw_image_single(fb, img, img->data[loop_count],
-				offset_x, offset_y, shift_x, shift_y, width, height, alpha_background);
-			usleep(img->delay[loop_count] * 10000); /* gif delay 1 == 1/100 sec */
+			/* screen shows the previous frame: draw only updated rectangle in view port */
+			rect   = get_frame_rect(img, loop_count);
+			x_from = (rect.x > shift_x) ? rect.x: shift_x;
+			y_from = (rect.y > shift_y) ? rect.y: shift_y;
+			x_to   = (rect.x + rect.width < shift_x + width) ? rect.x + rect.width: shift_x + width;
+			y_to   = (rect.y + rect.height < shift_y + height) ? rect.y + rect.height: shift_y + height;
+
+			if (x_from < x_to && y_from < y_to && (data = get_frame_data(img, loop_count)) != NULL)
+				draw_rect_single(fb, img, loop_count, data, rect, offset_x + x_from - shift_x, offset_y + y_from - shift_y,
+					x_from, y_from, x_to - x_from, y_to - y_from, alpha_background);
+			usleep(img->frames[loop_count].delay * 10000); /* gif delay 1 == 1/100 sec */
 			loop_count++;
 		}
-	} else {
-		draw_image_single(fb, img, img->data[img->current_frame],
+	} else if ((data = get_current_frame(img)) != NULL) {
+		draw_image_single(fb, img, data,
 			offset_x, offset_y, shift_x, shift_y, width, height, alpha_background);
 	}
 }
@@ -110,6 +110,12 @@ static inline uint32_t read_uint32(uint8_t *data, unsigned int o) {
 
 static bmp_result next_ico_image(ico_collection *ico, ico_image *image);
 static bmp_result bmp_analyse_header(bmp_image *bmp, unsigned char *data);
+static void bmp_row_bgr(uint8_t *restrict dst, const uint8_t *restrict src, uint32_t width,
+		uint32_t skip, uint8_t alpha);
+static void bmp_row_rgb555(uint8_t *restrict dst, const uint8_t *restrict src, uint32_t width,
+		uint8_t alpha);
+static void bmp_row_bitfields(bmp_image *bmp, uint8_t *restrict dst, const uint8_t *restrict src,
+		uint32_t width);
 static bmp_result bmp_decode_rgb24(bmp_image *bmp, uint8_t **start, int bytes);
 static bmp_result bmp_decode_rgb16(bmp_image *bmp, uint8_t **start, int bytes);
 static bmp_result bmp_decode_rgb(bmp_image *bmp, uint8_t **start, int bytes);
@@ -664,6 +670,118 @@ bmp_result bmp_decode_trans(bmp_image *bmp, uint32_t colour) {
 }
 
 
+/**
+ * Convert a row of 24bpp or 32bpp BGR pixels to RGBA.
+ *
+ * Each source pixel size has its own loop so that the compiler can
+ * vectorise it.
+ *
+ * \param dst	the row of RGBA pixels to write
+ * \param src	the row of BGR pixels to read
+ * \param width	the number of pixels in the row
+ * \param skip	the number of bytes per source pixel (3 or 4)
+ * \param alpha	the alpha value of every pixel
+ */
+static void bmp_row_bgr(uint8_t *restrict dst, const uint8_t *restrict src, uint32_t width,
+		uint32_t skip, uint8_t alpha) {
+	uint32_t x, word, colour;
+
+	if (skip == 3) {
+		for (x = 0; x < width; x++, dst += 4, src += 3) {
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = src[0];
+			dst[3] = alpha;
+		}
+	} else {
+		for (x = 0; x < width; x++, dst += 4, src += 4) {
+			word = src[0] | (src[1] << 8) | (src[2] << 16);
+			colour = ((word >> 16) & 0xff) | (word & 0xff00) |
+					((word & 0xff) << 16) | ((uint32_t)alpha << 24);
+			dst[0] = colour;
+			dst[1] = colour >> 8;
+			dst[2] = colour >> 16;
+			dst[3] = colour >> 24;
+		}
+	}
+}
+
+
+/**
+ * Convert a row of 16bpp RGB555 pixels to RGBA.
+ *
+ * \param dst	the row of RGBA pixels to write
+ * \param src	the row of RGB555 pixels to read
+ * \param width	the number of pixels in the row
+ * \param alpha	the alpha value of every pixel
+ */
+static void bmp_row_rgb555(uint8_t *restrict dst, const uint8_t *restrict src, uint32_t width,
+		uint8_t alpha) {
+	uint32_t x, word, colour;
+
+	for (x = 0; x < width; x++, dst += 4, src += 2) {
+		word = src[0] | (src[1] << 8);
+		colour = ((word >> 7) & 0xf8) | ((word << 6) & 0xf800) |
+				((word << 19) & 0xf80000) | ((uint32_t)alpha << 24);
+		dst[0] = colour;
+		dst[1] = colour >> 8;
+		dst[2] = colour >> 16;
+		dst[3] = colour >> 24;
+	}
+}
+
+
+/**
+ * Convert a row of 16bpp or 32bpp pixels to RGBA using the bitfield masks.
+ *
+ * The shift of every mask is split into a left and a right shift (one of
+ * them is zero), so each pixel is converted without branches.
+ *
+ * \param bmp	the BMP image being decoded
+ * \param dst	the row of RGBA pixels to write
+ * \param src	the row of pixels to read
+ * \param width	the number of pixels in the row
+ */
+static void bmp_row_bitfields(bmp_image *bmp, uint8_t *restrict dst, const uint8_t *restrict src,
+		uint32_t width) {
+	uint32_t mask[4], left[4], right[4];
+	uint32_t x, i, word, colour;
+	uint32_t alpha = bmp->opaque ? (0xffu << 24) : 0;
+
+	for (i = 0; i < 4; i++) {
+		mask[i] = bmp->mask[i];
+		left[i] = (bmp->shift[i] > 0) ? bmp->shift[i] : 0;
+		right[i] = (bmp->shift[i] < 0) ? -bmp->shift[i] : 0;
+	}
+
+	if (bmp->bpp == 16) {
+		for (x = 0; x < width; x++, dst += 4, src += 2) {
+			word = src[0] | (src[1] << 8);
+			colour = (((word & mask[0]) << left[0]) >> right[0]) |
+					(((word & mask[1]) << left[1]) >> right[1]) |
+					(((word & mask[2]) << left[2]) >> right[2]) |
+					(((word & mask[3]) << left[3]) >> right[3]) | alpha;
+			dst[0] = colour;
+			dst[1] = colour >> 8;
+			dst[2] = colour >> 16;
+			dst[3] = colour >> 24;
+		}
+	} else {
+		for (x = 0; x < width; x++, dst += 4, src += 4) {
+			word = src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+			colour = (((word & mask[0]) << left[0]) >> right[0]) |
+					(((word & mask[1]) << left[1]) >> right[1]) |
+					(((word & mask[2]) << left[2]) >> right[2]) |
+					(((word & mask[3]) << left[3]) >> right[3]) | alpha;
+			dst[0] = colour;
+			dst[1] = colour >> 8;
+			dst[2] = colour >> 16;
+			dst[3] = colour >> 24;
+		}
+	}
+}
+
+
 /**
  * Decode BMP data stored in 24bpp colour.
  *
@@ -713,7 +831,17 @@ static bmp_result bmp_decode_rgb24(bmp_image *bmp, uint8_t **start, int bytes) {
 			scanline = (void *)(top + (y * swidth));
 		else
 			scanline = (void *)(bottom - (y * swidth));
-		if (bmp->encoding == BMP_ENCODING_BITFIELDS) {
+		/* whole rows are converted at once unless pixels are compared
+		 * with the transparent colour
+		 */
+		if (!bmp->limited_trans) {
+			if (bmp->encoding == BMP_ENCODING_BITFIELDS)
+				bmp_row_bitfields(bmp, (uint8_t *)scanline, data, bmp->width);
+			else
+				bmp_row_bgr((uint8_t *)scanline, data, bmp->width, skip,
+						bmp->opaque ? 0xff : 0);
+			data += skip * bmp->width;
+		} else if (bmp->encoding == BMP_ENCODING_BITFIELDS) {
 			for (x = 0; x < bmp->width; x++) {
 				word = read_uint32(data, 0);
 				for (i = 0; i < 4; i++)
@@ -788,7 +916,17 @@ static bmp_result bmp_decode_rgb16(bmp_image *bmp, uint8_t **start, int bytes) {
 			scanline = (void *)(top + (y * swidth));
 		else
 			scanline = (void *)(bottom - (y * swidth));
-		if (bmp->encoding == BMP_ENCODING_BITFIELDS) {
+		/* whole rows are converted at once unless pixels are compared
+		 * with the transparent colour
+		 */
+		if (!bmp->limited_trans) {
+			if (bmp->encoding == BMP_ENCODING_BITFIELDS)
+				bmp_row_bitfields(bmp, (uint8_t *)scanline, data, bmp->width);
+			else
+				bmp_row_rgb555((uint8_t *)scanline, data, bmp->width,
+						bmp->opaque ? 0xff : 0);
+			data += 2 * bmp->width;
+		} else if (bmp->encoding == BMP_ENCODING_BITFIELDS) {
 			for (x = 0; x < bmp->width; x++) {
 				word = read_uint16(data, 0);
 				if ((bmp->limited_trans) && (word == bmp->transparent_index))
@@ -935,6 +1073,81 @@ static bmp_result bmp_decode_mask(bmp_image *bmp, uint8_t *data, int bytes) {
 }
 
 
+/**
+ * Count the pixels of an RLE run which fit in the image.
+ *
+ * Runs carry on at the start of the next row, so a run may cover
+ * everything up to the end of the last row.
+ *
+ * \param bmp		the BMP image being decoded
+ * \param x		the cursor column
+ * \param y		the cursor row
+ * \param length	the number of pixels in the run
+ * \return the number of pixels to write
+ */
+static inline uint32_t bmp_rle_pixels_left(bmp_image *bmp, uint32_t x, uint32_t y,
+		uint32_t length) {
+	uint64_t left;
+
+	if (y >= bmp->height)
+		return 0;
+	left = (uint64_t)(bmp->height - y) * bmp->width - x;
+	return (length < left) ? length : left;
+}
+
+
+/**
+ * Find the part of an RLE run that lies in one row.
+ *
+ * \param bmp		the BMP image being decoded
+ * \param top		the first row of the bitmap
+ * \param swidth	the number of bytes per bitmap row
+ * \param x		the cursor column, moved to the next row at the row end
+ * \param y		the cursor row, moved to the next row at the row end
+ * \param left		the number of pixels left in the run
+ * \param count	updated to the number of pixels to write in this row
+ * \return the first pixel to write
+ */
+static inline uint32_t *bmp_rle_span(bmp_image *bmp, uint8_t *top, uint32_t swidth,
+		uint32_t *x, uint32_t *y, uint32_t left, uint32_t *count) {
+	uint8_t *row;
+
+	if (*x >= bmp->width) {
+		*x = 0;
+		(*y)++;
+	}
+	*count = bmp->width - *x;
+	if (*count > left)
+		*count = left;
+	if (bmp->reversed)
+		row = top + (uint64_t)swidth * *y;
+	else
+		row = top + (uint64_t)swidth * (bmp->height - 1 - *y);
+	return (uint32_t *)row + *x;
+}
+
+
+/**
+ * Fill pixels with two alternating colours (the same one for RLE8).
+ *
+ * \param scanline	the first pixel to write
+ * \param count		the number of pixels to write
+ * \param pixel		the colour of even pixels
+ * \param pixel2	the colour of odd pixels
+ */
+static inline void bmp_rle_fill(uint32_t *restrict scanline, uint32_t count,
+		uint32_t pixel, uint32_t pixel2) {
+	uint32_t x;
+
+	for (x = 0; x + 1 < count; x += 2) {
+		scanline[x] = pixel;
+		scanline[x + 1] = pixel2;
+	}
+	if (x < count)
+		scanline[x] = pixel;
+}
+
+
 /**
  * Decode BMP data stored encoded in either RLE4 or RLE8.
  *
@@ -947,12 +1160,13 @@ static bmp_result bmp_decode_mask(bmp_image *bmp, uint8_t *data, int bytes) {
  *			in this case, the image may be partially viewable
  */
 static bmp_result bmp_decode_rle(bmp_image *bmp, uint8_t *data, int bytes, int size) {
-	uint8_t *top, *bottom, *end;
+	uint8_t *top, *end, *indices;
 	uint32_t *scanline;
-	uint32_t swidth;
-	uint32_t i, length, pixels_left;
+	uint32_t palette[256];
+	uint32_t swidth, colours;
+	uint32_t i, j, n, length, count, run_bytes;
 	uint32_t x = 0, y = 0, last_y = 0;
-	uint32_t pixel = 0, pixel2;
+	uint32_t pixel, pixel2;
 
 	if (bmp->ico)
 		return BMP_DATA_ERROR;
@@ -961,10 +1175,14 @@ static bmp_result bmp_decode_rle(bmp_image *bmp, uint8_t *data, int bytes, int s
 	top = bmp->bitmap_callbacks.bitmap_get_buffer(bmp->bitmap);
 	if (!top)
 		return BMP_INSUFFICIENT_MEMORY;
-	bottom = top + (uint64_t)swidth * (bmp->height - 1);
 	end = data + bytes;
 	bmp->decoded = true;
 
+	/* indices beyond the colour table are black rather than stray memory */
+	colours = (bmp->colours < 256) ? bmp->colours : 256;
+	memcpy(palette, bmp->colour_table, colours * 4);
+	memset(palette + colours, 0, (256 - colours) * 4);
+
 	do {
 		if (data + 2 > end)
 			return BMP_INSUFFICIENT_DATA;
@@ -994,100 +1212,51 @@ static bmp_result bmp_decode_rle(bmp_image *bmp, uint8_t *data, int bytes, int s
 					return BMP_DATA_ERROR;
 			} else {
 				/* 00 - NN means escape NN pixels */
-				if (bmp->reversed) {
-					pixels_left = (y + 1) * bmp->width - x;
-					scanline = (void *)(top + (y * swidth));
-				} else {
-					pixels_left = (bmp->height - y + 1) * bmp->width - x;
-					scanline = (void *)(bottom - (y * swidth));
-				}
-				if (length > pixels_left)
-					length = pixels_left;
-				if (data + length > end)
+				run_bytes = (size == 8) ? length : ((length + 1) >> 1);
+				if (data + run_bytes > end)
 					return BMP_INSUFFICIENT_DATA;
-
-				/* the following code could be easily optimised by simply
-				 * checking the bounds on entry and using some simply copying
-				 * routines if so */
-				if (size == 8) {
-					for (i = 0; i < length; i++) {
-						if (x >= bmp->width) {
-							x = 0;
-							if (++y > bmp->height)
-								return BMP_DATA_ERROR;
-							scanline -= bmp->width;
-						}
-						scanline[x++] = bmp->colour_table[(int)*data++];
-					}
-				} else {
-					for (i = 0; i < length; i++) {
-						if (x >= bmp->width) {
-							x = 0;
-							if (++y > bmp->height)
-								return BMP_DATA_ERROR;
-							scanline -= bmp->width;
-						}
-						if ((i & 1) == 0) {
-							pixel = *data++;
-							scanline[x++] = bmp->colour_table
-									[pixel >> 4];
-						} else {
-							scanline[x++] = bmp->colour_table
-									[pixel & 0xf];
-						}
+				indices = data;
+				count = bmp_rle_pixels_left(bmp, x, y, length);
+				for (i = 0; i < count; i += n) {
+					scanline = bmp_rle_span(bmp, top, swidth, &x, &y, count - i, &n);
+					if (size == 8) {
+						for (j = 0; j < n; j++)
+							scanline[j] = palette[indices[i + j]];
+					} else {
+						for (j = i; j < i + n; j++)
+							scanline[j - i] = palette[(j & 1) ?
+									(indices[j >> 1] & 0xf) :
+									(indices[j >> 1] >> 4)];
 					}
-					length = (length + 1) >> 1;
+					x += n;
 				}
-				if ((length & 1) && (*data++ != 0x00))
+				data += run_bytes;
+				if ((run_bytes & 1) && (data < end) && (*data++ != 0x00))
 					return BMP_DATA_ERROR;
-
 			}
 		} else {
 			/* NN means perform RLE for NN pixels */
-			if (bmp->reversed) {
-				pixels_left = (y + 1) * bmp->width - x;
-				scanline = (void *)(top + (y * swidth));
-			} else {
-				pixels_left = (bmp->height - y + 1) * bmp->width - x;
-				scanline = (void *)(bottom - (y * swidth));
-			}
-			if (length > pixels_left)
-				length = pixels_left;
-			
-			/* boundary checking */
 			if (data + 1 > end)
 				return BMP_INSUFFICIENT_DATA;
-
-			/* the following code could be easily optimised by simply
-			 * checking the bounds on entry and using some simply copying
-			 * routines if so */
 			if (size == 8) {
-				pixel = bmp->colour_table[(int)*data++];
-				for (i = 0; i < length; i++) {
-					if (x >= bmp->width) {
-						x = 0;
-						if (++y > bmp->height)
-							return BMP_DATA_ERROR;
-						scanline -= bmp->width;
-					}
-					scanline[x++] = pixel;
-				}
+				pixel = palette[*data];
+				pixel2 = pixel;
 			} else {
-				pixel2 = *data++;
-				pixel = bmp->colour_table[pixel2 >> 4];
-				pixel2 = bmp->colour_table[pixel2 & 0xf];
-				for (i = 0; i < length; i++) {
-					if (x >= bmp->width) {
-						x = 0;
-						if (++y > bmp->height)
-							return BMP_DATA_ERROR;
-						scanline -= bmp->width;
-					}
-					if ((i & 1) == 0)
-						scanline[x++] = pixel;
-					else
-						scanline[x++] = pixel2;
-				}
+				pixel = palette[*data >> 4];
+				pixel2 = palette[*data & 0xf];
+			}
+			data++;
+			count = bmp_rle_pixels_left(bmp, x, y, length);
+			for (i = 0; i < count; i += n) {
+				scanline = bmp_rle_span(bmp, top, swidth, &x, &y, count - i, &n);
+				/* a run split across rows carries on with the same
+				 * one of the two alternating pixels
+				 */
+				if (i & 1)
+					bmp_rle_fill(scanline, n, pixel2, pixel);
+				else
+					bmp_rle_fill(scanline, n, pixel, pixel2);
+				x += n;
 			}
 		}
 	} while (data < end);
@@ -28,8 +28,11 @@
 	the 'gif_data' and 'buffer_size' set to their initial values. The
 	'buffer_position' should initially be 0, and will be internally updated
 	as the decoding commences. The caller should then repeatedly call
-	gif_initialise() with the structure until the function returns 1, or
-	no more data is avaliable.
+	gif_initialise() with the structure until the function returns 0, or
+	no more data is avaliable. GIF_WORKING is returned once, as soon as the first
+	frame is complete, so it can be shown while later frames are found.
+	While 'more_data' is set, data ending inside a frame is not treated as
+	the end of the GIF: the frame is scanned again when more data is given.
 
 	Once the initialisation has begun, the decoder completes the variables
 	'frame_count' and 'frame_count_partial'. The former being the total
@@ -86,10 +89,6 @@
 
 /*	GIF Flags
 */
-#define GIF_FRAME_COMBINE 1
-#define GIF_FRAME_CLEAR 2
-#define GIF_FRAME_RESTORE 3
-#define GIF_FRAME_QUIRKS_RESTORE 4
 #define GIF_IMAGE_SEPARATOR 0x2c
 #define GIF_INTERLACE_MASK 0x40
 #define GIF_COLOUR_TABLE_MASK 0x80
@@ -111,37 +110,45 @@ static gif_result gif_initialise_frame(gif_animation *gif);
 static gif_result gif_initialise_frame_extensions(gif_animation *gif, const int frame);
 static gif_result gif_skip_frame_extensions(gif_animation *gif);
 static unsigned int gif_interlaced_line(int height, int y);
+static void gif_plot_row(unsigned int *scanline, const unsigned char *row, unsigned int count,
+		const unsigned int *colour_table, bool transparency, unsigned char transparency_index);
 
 
 
 /*	Internal LZW routines
 */
-static void gif_init_LZW(gif_animation *gif);
-static bool gif_next_LZW(gif_animation *gif);
-static int gif_next_code(gif_animation *gif, int code_size);
-
-/*	General LZW values. They are shared for all GIFs being decoded, and
-	thus we can't handle progressive decoding efficiently without having
-	the data for each image which would use an extra 10Kb or so per GIF.
-*/
-static unsigned char buf[4];
-static unsigned char *direct;
-static int maskTbl[16] = {0x0000, 0x0001, 0x0003, 0x0007, 0x000f, 0x001f, 0x003f, 0x007f,
-			  0x00ff, 0x01ff, 0x03ff, 0x07ff, 0x0fff, 0x1fff, 0x3fff, 0x7fff};
-static int table[2][(1 << GIF_MAX_LZW)];
-static unsigned char stack[(1 << GIF_MAX_LZW) * 2];
-static unsigned char *stack_pointer;
-static int code_size, set_code_size;
-static int max_code, max_code_size;
-static int clear_code, end_code;
-static int curbit, lastbit, last_byte;
-static int firstcode, oldcode;
-static bool zero_data_block = false;
-static bool get_done;
-
-/*	Whether to clear the decoded image rather than plot
+struct gif_lzw;
+static gif_result gif_decode_LZW(const unsigned char *data, unsigned int data_size, unsigned int data_position,
+		unsigned int set_code_size, unsigned char *indices, unsigned int size, unsigned int *decoded);
+static bool gif_fill_bits(struct gif_lzw *lzw, int code_size);
+
+/*	LZW decoding state of one frame. It lives on the stack of the decoding
+	call (32Kb or so), so any number of frames and GIFs can be decoded at
+	the same time.
+
+	Every string in the table (except the roots) is a copy of indices
+	decoded before, so an entry is only the offset and length of that
+	earlier output and a code is emitted with a single block copy.
 */
-static bool clear_image = false;
+struct gif_lzw {
+	const unsigned char *data;	/* GIF data and its size */
+	unsigned int data_size;
+	unsigned int position;		/* next byte to read */
+	uint64_t bit_buffer;		/* pending bits: the next code is in the lowest bits */
+	int bit_count;
+	unsigned int block_left;	/* bytes left in the current data sub-block */
+	bool get_done;			/* block terminator has been read */
+	bool get_short;			/* data ends inside a sub-block */
+	struct {
+		unsigned int offset;
+		unsigned int length;
+	} table[1 << GIF_MAX_LZW];
+};
+
+static gif_result gif_internal_decode_frame(gif_animation *gif, unsigned int frame, bool clear_image,
+		gif_indices *predecoded);
+static bool gif_locate_frame_data(gif_animation *gif, unsigned int frame,
+		unsigned int *position, unsigned int *width, unsigned int *height);
 
 
 
@@ -279,7 +286,7 @@ gif_result gif_initialise(gif_animation *gif, size_t size, unsigned char *data)
 		/*	Check if the GIF has no frame data (13-byte header + 1-byte termination block)
 		 *	Although generally useless, the GIF specification does not expressly prohibit this
 		 */
-		if (gif->buffer_size == 14) {
+		if ((gif->buffer_size == 14) && !gif->more_data) {
 			if (gif_data[0] == GIF_TRAILER)
 				return GIF_OK;
 			else
@@ -314,7 +321,7 @@ gif_result gif_initialise(gif_animation *gif, size_t size, unsigned char *data)
 		/*	Check for a global colour map signified by bit 7
 		*/
 		if (gif->global_colours) {
-			if (gif->buffer_size < (gif->colour_table_size * 3 + 12)) {
+			if (gif->buffer_size < (gif->colour_table_size * 3 + 13)) {
 				return GIF_INSUFFICIENT_DATA;
 			}
 			for (index = 0; index < gif->colour_table_size; index++) {
@@ -349,9 +356,34 @@ gif_result gif_initialise(gif_animation *gif, size_t size, unsigned char *data)
 		}
 	}
 
-	/*	Repeatedly try to initialise frames
+	/*	Repeatedly try to initialise frames, stopping once the first frame
+		is complete so that the caller can decode it before the rest
+	*/
+	while ((return_value = gif_initialise_frame(gif)) == GIF_WORKING) {
+		if (!gif->first_frame_reported) {
+			gif->first_frame_reported = true;
+			return GIF_WORKING;
+		}
+	}
+
+	/*	If the data ran out inside a frame, rescan it from its start (so its
+		extensions are read again) when more data is given
+	*/
+	if (((return_value == GIF_INSUFFICIENT_DATA) ||
+			(return_value == GIF_INSUFFICIENT_FRAME_DATA)) &&
+			(gif->frame_holders > gif->frame_count))
+		gif->buffer_position = gif->frames[gif->frame_count].frame_pointer;
+
+	/*	The data may also run out just after the first frame: it is still
+		reported before waiting for more data
 	*/
-	while ((return_value = gif_initialise_frame(gif)) == GIF_WORKING);
+	if (((return_value == GIF_INSUFFICIENT_DATA) ||
+			(return_value == GIF_INSUFFICIENT_FRAME_DATA)) &&
+			gif->more_data && (gif->frame_count > 0) &&
+			!gif->first_frame_reported) {
+		gif->first_frame_reported = true;
+		return GIF_WORKING;
+	}
 
 	/*	If there was a memory error tell the caller
 	*/
@@ -509,6 +541,7 @@ static gif_result gif_initialise_frame(gif_animation *gif) {
 	/*	If we're not done, there should be an image descriptor
 	*/
 	if (gif_data[0] != GIF_IMAGE_SEPARATOR) return GIF_FRAME_DATA_ERROR;
+	if (gif_bytes < 10) return GIF_INSUFFICIENT_FRAME_DATA;
 
 	/*	Do some simple boundary checking
 	*/
@@ -567,9 +600,10 @@ static gif_result gif_initialise_frame(gif_animation *gif) {
 	*/
 	if (flags & GIF_COLOUR_TABLE_MASK) {
 		gif_data += 3 * colour_table_size;
-		if ((gif_bytes = (gif_end - gif_data)) < 0)
-			return GIF_INSUFFICIENT_FRAME_DATA;
+		gif_bytes = (gif_end - gif_data);
 	}
+	if (gif_bytes < 1)
+		return GIF_INSUFFICIENT_FRAME_DATA;
 
 	/*	Ensure we have a correct code size
 	*/
@@ -587,6 +621,14 @@ static gif_result gif_initialise_frame(gif_animation *gif) {
 	*/
 	block_size = 0;
 	while (block_size != 1) {
+		/*	Data ends between two blocks: the frame ends here unless
+			the rest is still to come
+		*/
+		if (gif_bytes < 1) {
+			if (gif->more_data)
+				return GIF_INSUFFICIENT_FRAME_DATA;
+			break;
+		}
 		block_size = gif_data[0] + 1;
 		/*	Check if the frame data runs off the end of the file
 		*/
@@ -595,9 +637,9 @@ static gif_result gif_initialise_frame(gif_animation *gif) {
 			 *	Once we get garbage data, there is no logical
 			 *	way to determine where the next frame is.
 			 *	It's probably better to partially load the gif
-			 *	than not at all.
+			 *	than not at all. (Unless the rest is still to come.)
 			*/
-			if (gif_bytes >= 2) {
+			if ((gif_bytes >= 2) && !gif->more_data) {
 				gif_data[0] = 0;
 				gif_data[1] = GIF_TRAILER;
 				gif_bytes = 1;
@@ -748,6 +790,99 @@ static gif_result gif_initialise_frame_extensions(gif_animation *gif, const int
 			gif->current_error is set to GIF_FRAME_NO_DISPLAY
 */
 gif_result gif_decode_frame(gif_animation *gif, unsigned int frame) {
+	return gif_internal_decode_frame(gif, frame, false, NULL);
+}
+
+/**	Decodes a GIF frame as gif_decode_frame(), plotting indices which were
+	decompressed in advance by gif_decode_frame_indices() (if they belong
+	to this frame) rather than decompressing the frame again.
+*/
+gif_result gif_decode_frame_with_indices(gif_animation *gif, unsigned int frame, gif_indices *indices) {
+	return gif_internal_decode_frame(gif, frame, false, indices);
+}
+
+/**	Decompresses the colour indices of a GIF frame without plotting them.
+
+	The animation is only read, so any number of frames can be decompressed
+	at the same time (on different threads) while no other call is made on
+	the animation. indices->data is NULL if the frame has no image data to
+	decompress: gif_decode_frame_with_indices() does the whole work then.
+
+	@return the result of the decompression (also in indices->result)
+*/
+gif_result gif_decode_frame_indices(gif_animation *gif, unsigned int frame, gif_indices *indices) {
+	unsigned int position, width, height;
+
+	indices->frame = frame;
+	indices->data = NULL;
+	indices->decoded = 0;
+
+	if (frame > gif->frame_count_partial)
+		return (indices->result = GIF_INSUFFICIENT_DATA);
+	if ((gif->frames[frame].display == false) ||
+			!gif_locate_frame_data(gif, frame, &position, &width, &height) ||
+			(width * height == 0))
+		return (indices->result = GIF_OK);
+
+	if ((indices->data = malloc(width * height)) == NULL)
+		return (indices->result = GIF_INSUFFICIENT_MEMORY);
+	indices->result = gif_decode_LZW(gif->gif_data, gif->buffer_size, position + 1,
+			gif->gif_data[position], indices->data, width * height, &indices->decoded);
+
+	return indices->result;
+}
+
+/**	Finds the image data of a frame by reading the GIF data only
+
+	@param position	updated to the offset of the LZW minimum code size
+	@return false if the frame has no complete image descriptor or image data
+*/
+static bool gif_locate_frame_data(gif_animation *gif, unsigned int frame,
+		unsigned int *position, unsigned int *width, unsigned int *height) {
+	unsigned char *gif_data, *gif_end;
+	unsigned int flags;
+
+	gif_data = gif->gif_data + gif->frames[frame].frame_pointer;
+	gif_end = gif->gif_data + gif->buffer_size;
+
+	/*	Skip the extensions (see gif_skip_frame_extensions())
+	*/
+	while ((gif_end - gif_data >= 3) && (gif_data[0] == GIF_EXTENSION_INTRODUCER)) {
+		if (gif_data[1] == GIF_EXTENSION_COMMENT)
+			gif_data += 2;
+		else
+			gif_data += 3 + gif_data[2];
+		while ((gif_data < gif_end) && (gif_data[0] != GIF_BLOCK_TERMINATOR))
+			gif_data += gif_data[0] + 1;
+		if (gif_data >= gif_end)
+			return false;
+		++gif_data;
+	}
+
+	/*	10-byte image descriptor, colour table, then LZW code size and the
+		first data sub-block
+	*/
+	if ((gif_end - gif_data < 12) || (gif_data[0] != GIF_IMAGE_SEPARATOR))
+		return false;
+	*width = gif_data[5] | (gif_data[6] << 8);
+	*height = gif_data[7] | (gif_data[8] << 8);
+	flags = gif_data[9];
+	gif_data += 10;
+	if (flags & GIF_COLOUR_TABLE_MASK)
+		gif_data += 3 * (2 << (flags & GIF_COLOUR_TABLE_SIZE_MASK));
+	if ((gif_end - gif_data < 2) || (gif_data[0] == GIF_TRAILER) ||
+			((gif_end - gif_data == 2) && (gif_data[1] == GIF_TRAILER)))
+		return false;
+
+	*position = gif_data - gif->gif_data;
+	return true;
+}
+
+/**	Decodes a GIF frame, or clears its area (clear_image) when the frame
+	is disposed to the background colour.
+*/
+static gif_result gif_internal_decode_frame(gif_animation *gif, unsigned int frame, bool clear_image,
+		gif_indices *predecoded) {
 	unsigned int index = 0;
 	unsigned char *gif_data, *gif_end;
 	int gif_bytes;
@@ -757,10 +892,13 @@ gif_result gif_decode_frame(gif_animation *gif, unsigned int frame) {
 	unsigned int *frame_data = 0;	// Set to 0 for no warnings
 	unsigned int *frame_scanline;
 	unsigned int save_buffer_position;
-	unsigned int return_value = 0;
-	unsigned int x, y, decode_y, burst_bytes;
+	gif_result return_value = GIF_OK;
+	unsigned int x, y, decode_y;
+	unsigned char *indices, *row;
+	unsigned int decoded = 0;
+	bool transparency;
+	unsigned char transparency_index;
 	int last_undisposed_frame = (frame - 1);
-	register unsigned char colour;
 
 	/*	Ensure this frame is supposed to be decoded
 	*/
@@ -925,15 +1063,13 @@ gif_result gif_decode_frame(gif_animation *gif, unsigned int frame) {
 			 * transparency we likely wouldn't want to do that. */
 			/* memset((char*)frame_data, colour_table[gif->background_index], gif->width * gif->height * sizeof(int)); */
 		} else if ((frame != 0) && (gif->frames[frame - 1].disposal_method == GIF_FRAME_CLEAR)) {
-			clear_image = true;
-			if ((return_value = gif_decode_frame(gif, (frame - 1))) != GIF_OK)
+			if ((return_value = gif_internal_decode_frame(gif, (frame - 1), true, NULL)) != GIF_OK)
 				goto gif_decode_frame_exit;
-			clear_image = false;
 		/*	If the previous frame's disposal method requires we restore the previous
 		 *	image, find the last image set to "do not dispose" and get that frame data
 		*/
 		} else if ((frame != 0) && (gif->frames[frame - 1].disposal_method == GIF_FRAME_RESTORE)) {
-			while ((last_undisposed_frame != -1) && (gif->frames[--last_undisposed_frame].disposal_method == GIF_FRAME_RESTORE))
+			while ((--last_undisposed_frame != -1) && (gif->frames[last_undisposed_frame].disposal_method == GIF_FRAME_RESTORE))
 				;
 
 			/*	If we don't find one, clear the frame data
@@ -954,64 +1090,49 @@ gif_result gif_decode_frame(gif_animation *gif, unsigned int frame) {
 		}
 		gif->decoded_frame = frame;
 
-		/*	Initialise the LZW decoding
+		/*	Decompress the whole frame into colour indices (unless done already)
 		*/
-		set_code_size = gif_data[0];
-		gif->buffer_position = (gif_data - gif->gif_data) + 1;
+		if (width * height == 0) {
+			return_value = GIF_OK;
+			goto gif_decode_frame_exit;
+		}
+		if (predecoded && predecoded->data && (predecoded->frame == frame)) {
+			indices = predecoded->data;
+			decoded = predecoded->decoded;
+			gif->current_error = return_value = predecoded->result;
+		} else {
+			if ((indices = malloc(width * height)) == NULL) {
+				return_value = GIF_INSUFFICIENT_MEMORY;
+				goto gif_decode_frame_exit;
+			}
+			gif->current_error = return_value = gif_decode_LZW(gif->gif_data,
+					gif->buffer_size, (gif_data - gif->gif_data) + 1,
+					gif_data[0], indices, width * height, &decoded);
+		}
 
-		/*	Set our code variables
-		*/
-		code_size = set_code_size + 1;
-		clear_code = (1 << set_code_size);
-		end_code = clear_code + 1;
-		max_code_size = clear_code << 1;
-		max_code = clear_code + 2;
-		curbit = lastbit = 0;
-		last_byte = 2;
-		get_done = false;
-		direct = buf;
-		gif_init_LZW(gif);
-
-		/*	Decompress the data
+		/*	Plot the rows decoded so far (an unexpected end of frame leaves
+			the rest transparent)
 		*/
-		for (y = 0; y < height; y++) {
+		transparency = gif->frames[frame].transparency;
+		transparency_index = gif->frames[frame].transparency_index;
+		for (y = 0; y < height && y * width < decoded; y++) {
 			if (interlace)
 				decode_y = gif_interlaced_line(height, y) + offset_y;
 			else
 				decode_y = y + offset_y;
 			frame_scanline = frame_data + offset_x + (decode_y * gif->width);
+			row = indices + y * width;
+			x = (decoded - y * width < width) ? decoded - y * width: width;
 
-			/*	Rather than decoding pixel by pixel, we try to burst out streams
-				of data to remove the need for end-of data checks every pixel.
-			*/
-			x = width;
-			while (x > 0) {
-				burst_bytes = (stack_pointer - stack);
-				if (burst_bytes > 0) {
-					if (burst_bytes > x)
-						burst_bytes = x;
-					x -= burst_bytes;
-					while (burst_bytes-- > 0) {
-						colour = *--stack_pointer;
-						if (((gif->frames[frame].transparency) &&
-							(colour != gif->frames[frame].transparency_index)) ||
-							(!gif->frames[frame].transparency))
-								*frame_scanline = colour_table[colour];
-						frame_scanline++;
-					}
-				} else {
-					if (!gif_next_LZW(gif)) {
-						/*	Unexpected end of frame, try to recover
-						*/
-						if (gif->current_error == GIF_END_OF_FRAME)
-							return_value = GIF_OK;
-						else
-							return_value = gif->current_error;
-						goto gif_decode_frame_exit;
-					}
-				}
-			}
+			gif_plot_row(frame_scanline, row, x, colour_table, transparency, transparency_index);
 		}
+		if (indices != (predecoded ? predecoded->data : NULL))
+			free(indices);
+
+		/*	Unexpected end of frame, try to recover
+		*/
+		if (return_value == GIF_END_OF_FRAME)
+			return_value = GIF_OK;
 	} else {
 		/*	Clear our frame
 		*/
@@ -1110,6 +1231,52 @@ static gif_result gif_skip_frame_extensions(gif_animation *gif) {
 	return GIF_OK;
 }
 
+/*	Plots a row of colour indices. Rows without a transparent pixel are a
+	plain table lookup. Other rows are tested 8 indices at a time (as one
+	64-bit word): groups without a transparent pixel are looked up, fully
+	transparent groups are skipped and mixed groups select between the
+	colour and the pixel already plotted without a branch per pixel.
+*/
+static void gif_plot_row(unsigned int *scanline, const unsigned char *row, unsigned int count,
+		const unsigned int *colour_table, bool transparency, unsigned char transparency_index) {
+	const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+	uint64_t group, pattern = ones * transparency_index;
+	unsigned int x = 0, i, keep;
+
+	if (!transparency || !memchr(row, transparency_index, count)) {
+		for (; x + 4 <= count; x += 4) {
+			scanline[x] = colour_table[row[x]];
+			scanline[x + 1] = colour_table[row[x + 1]];
+			scanline[x + 2] = colour_table[row[x + 2]];
+			scanline[x + 3] = colour_table[row[x + 3]];
+		}
+		for (; x < count; x++)
+			scanline[x] = colour_table[row[x]];
+		return;
+	}
+
+	for (; x + 8 <= count; x += 8) {
+		/*	transparent indices become zero bytes */
+		memcpy(&group, row + x, 8);
+		group ^= pattern;
+		if (group == 0)
+			continue;
+		if (((group - ones) & ~group & highs) == 0) {
+			for (i = x; i < x + 8; i++)
+				scanline[i] = colour_table[row[i]];
+			continue;
+		}
+		for (i = x; i < x + 8; i++) {
+			keep = -(unsigned int)(row[i] == transparency_index);
+			scanline[i] = (scanline[i] & keep) | (colour_table[row[i]] & ~keep);
+		}
+	}
+	for (; x < count; x++) {
+		keep = -(unsigned int)(row[x] == transparency_index);
+		scanline[x] = (scanline[x] & keep) | (colour_table[row[x]] & ~keep);
+	}
+}
+
 static unsigned int gif_interlaced_line(int height, int y) {
 	if ((y << 3) < height) return (y << 3);
 	y -= ((height + 7) >> 3);
@@ -1139,148 +1306,145 @@ void gif_finalise(gif_animation *gif) {
 }
 
 /**
- * Initialise LZW decoding
+ * Decode the LZW compressed image data of a frame into colour indices
+ *
+ * \param data           the GIF data of data_size bytes
+ * \param data_position  offset of the first data sub-block of the frame
+ * \param set_code_size  the LZW minimum code size of the frame
+ * \param indices        buffer for size indices
+ * \param decoded        updated to the number of indices decoded, also on error
+ * \return GIF_OK when the buffer is filled, GIF_END_OF_FRAME if the data ends
+ *         before that, or an error code
  */
-void gif_init_LZW(gif_animation *gif) {
-	int i;
-
-	gif->current_error = 0;
-	if (clear_code >= (1 << GIF_MAX_LZW)) {
-		stack_pointer = stack;
-		gif->current_error = GIF_FRAME_DATA_ERROR;
-		return;
-	}
-
-	/* initialise our table */
-	memset(table, 0x00, (1 << GIF_MAX_LZW) * 8);
-	for (i = 0; i < clear_code; ++i)
-		table[1][i] = i;
-
-	/* update our LZW parameters */
+static gif_result gif_decode_LZW(const unsigned char *data, unsigned int data_size, unsigned int data_position,
+		unsigned int set_code_size, unsigned char *indices, unsigned int size, unsigned int *decoded) {
+	struct gif_lzw lzw;
+	unsigned int clear_code, end_code;
+	unsigned int code, code_size, max_code, max_code_size;
+	unsigned int position = 0, length;
+	unsigned int old_offset = 0, old_length = 0;	/* previous string (0: none after a clear code) */
+	gif_result result = GIF_OK;
+
+	*decoded = 0;
+	if (set_code_size >= GIF_MAX_LZW)
+		return GIF_FRAME_DATA_ERROR;
+
+	clear_code = (1 << set_code_size);
+	end_code = clear_code + 1;
 	code_size = set_code_size + 1;
-	max_code_size = clear_code << 1;
 	max_code = clear_code + 2;
-	stack_pointer = stack;
-	do {
-		firstcode = oldcode = gif_next_code(gif, code_size);
-	} while (firstcode == clear_code);
-	*stack_pointer++ =firstcode;
-}
-
-
-static bool gif_next_LZW(gif_animation *gif) {
-	int code, incode;
-	int block_size;
-	int new_code;
+	max_code_size = clear_code << 1;
 
-	code = gif_next_code(gif, code_size);
-	if (code < 0) {
-	  	gif->current_error = code;
-		return false;
-	} else if (code == clear_code) {
-		gif_init_LZW(gif);
-		return true;
-	} else if (code == end_code) {
-		/* skip to the end of our data so multi-image GIFs work */
-		if (zero_data_block) {
-			gif->current_error = GIF_FRAME_DATA_ERROR;
-			return false;
+	lzw.data = data;
+	lzw.data_size = data_size;
+	lzw.position = data_position;
+	lzw.bit_buffer = 0;
+	lzw.bit_count = 0;
+	lzw.block_left = 0;
+	lzw.get_done = lzw.get_short = false;
+
+	while (position < size) {
+		if ((lzw.bit_count < (int)code_size) && !gif_fill_bits(&lzw, code_size)) {
+			result = lzw.get_done ? GIF_END_OF_FRAME : GIF_INSUFFICIENT_FRAME_DATA;
+			break;
 		}
-		block_size = 0;
-		while (block_size != 1) {
-			block_size = gif->gif_data[gif->buffer_position] + 1;
-			gif->buffer_position += block_size;
+		code = lzw.bit_buffer & ((1 << code_size) - 1);
+		lzw.bit_buffer >>= code_size;
+		lzw.bit_count -= code_size;
+
+		if (code == clear_code) {
+			code_size = set_code_size + 1;
+			max_code = clear_code + 2;
+			max_code_size = clear_code << 1;
+			old_length = 0;
+			continue;
+		} else if (code == end_code) {
+			result = GIF_FRAME_DATA_ERROR;
+			break;
 		}
-		gif->current_error = GIF_FRAME_DATA_ERROR;
-		return false;
-	}
-
-	incode = code;
-	if (code >= max_code) {
-		*stack_pointer++ = firstcode;
-		code = oldcode;
-	}
 
-	/* The following loop is the most important in the GIF decoding cycle as every
-	 * single pixel passes through it.
-	 *
-	 * Note: our stack is always big enough to hold a complete decompressed chunk. */
-	while (code >= clear_code) {
-		*stack_pointer++ = table[1][code];
-		new_code = table[0][code];
-		if (new_code < clear_code) {
-			code = new_code;
+		/* The following is the most important part in the GIF decoding cycle
+		 * as every single pixel passes through it: strings are copied from
+		 * where they were decoded before, the output never has to be reversed. */
+		if (code < clear_code) {
+			indices[position] = code;
+			length = 1;
+		} else if (old_length == 0) {
+			result = GIF_FRAME_DATA_ERROR;
 			break;
+		} else if (code < max_code) {
+			length = lzw.table[code].length;
+			if ((length <= 8) && (size - position >= 8) && (lzw.table[code].offset + 8 <= position)) {
+				/* short string: copy a whole word of decoded output,
+				 * the rest is overwritten later */
+				uint64_t word;
+				memcpy(&word, indices + lzw.table[code].offset, 8);
+				memcpy(indices + position, &word, 8);
+			} else {
+				if (length > size - position)
+					length = size - position;
+				memcpy(indices + position, indices + lzw.table[code].offset, length);
+			}
+		} else {
+			/* the code being defined: previous string and its own first index */
+			length = old_length;
+			if (length >= size - position) {
+				length = size - position;
+				memcpy(indices + position, indices + old_offset, length);
+			} else {
+				memcpy(indices + position, indices + old_offset, length);
+				indices[position + length] = indices[old_offset];
+				length++;
+			}
 		}
-		*stack_pointer++ = table[1][new_code];
-		code = table[0][new_code];
-		if (code == new_code) {
-		  	gif->current_error = GIF_FRAME_DATA_ERROR;
-			return false;
-		}
-	}
-
-	*stack_pointer++ = firstcode = table[1][code];
 
-	if ((code = max_code) < (1 << GIF_MAX_LZW)) {
-		table[0][code] = oldcode;
-		table[1][code] = firstcode;
-		++max_code;
-		if ((max_code >= max_code_size) && (max_code_size < (1 << GIF_MAX_LZW))) {
-			max_code_size = max_code_size << 1;
-			++code_size;
+		/* new string: previous string followed by the first index of this one */
+		if ((old_length > 0) && (max_code < (1 << GIF_MAX_LZW))) {
+			lzw.table[max_code].offset = old_offset;
+			lzw.table[max_code].length = old_length + 1;
+			if ((++max_code >= max_code_size) && (max_code_size < (1 << GIF_MAX_LZW))) {
+				max_code_size = max_code_size << 1;
+				++code_size;
+			}
 		}
+		old_offset = position;
+		old_length = length;
+		position += length;
 	}
-	oldcode = incode;
-	return true;
+
+	*decoded = position;
+	return result;
 }
 
-static int gif_next_code(gif_animation *gif, int code_size) {
-	int i, j, end, count, ret;
-	unsigned char *b;
-
-	end = curbit + code_size;
-	if (end >= lastbit) {
-		if (get_done)
-			return GIF_END_OF_FRAME;
-		buf[0] = direct[last_byte - 2];
-		buf[1] = direct[last_byte - 1];
-
-		/* get the next block */
-		direct = gif->gif_data + gif->buffer_position;
-		zero_data_block = ((count = direct[0]) == 0);
-		if ((gif->buffer_position + count) >= gif->buffer_size)
-			return GIF_INSUFFICIENT_FRAME_DATA;
-		if (count == 0)
-			get_done = true;
-		else {
-			direct -= 1;
-			buf[2] = direct[2];
-			buf[3] = direct[3];
-		}
-		gif->buffer_position += count + 1;
+/**
+ * Refill the bit buffer from the data sub-blocks
+ *
+ * \return true if at least code_size bits are available
+ */
+static bool gif_fill_bits(struct gif_lzw *lzw, int code_size) {
+	const unsigned char *data = lzw->data;
+	unsigned int position = lzw->position;
 
-		/* update our variables */
-		last_byte = 2 + count;
-		curbit = (curbit - lastbit) + 16;
-		lastbit = (2 + count) << 3;
-		end = curbit + code_size;
+	while (lzw->bit_count <= 56) {
+		if (lzw->block_left == 0) {
+			if (lzw->get_done || lzw->get_short)
+				break;
+			/* get the next block */
+			if ((position >= lzw->data_size) ||
+					((position + data[position]) >= lzw->data_size)) {
+				lzw->get_short = true;
+				break;
+			}
+			if ((lzw->block_left = data[position++]) == 0) {
+				lzw->get_done = true;
+				break;
+			}
+		}
+		lzw->bit_buffer |= (uint64_t)data[position++] << lzw->bit_count;
+		lzw->bit_count += 8;
+		lzw->block_left--;
 	}
+	lzw->position = position;
 
-	i = curbit >> 3;
-	if (i < 2)
-		b = buf;
-	else
-		b = direct;
-
-	ret = b[i];
-	j = (end >> 3) - 1;
-	if (i <= j) {
-		ret |= (b[i + 1] << 8);
-		if (i < j)
-			ret |= (b[i + 2] << 16);
-	}
-	ret = (ret >> (curbit % 8)) & maskTbl[code_size];
-	curbit += code_size;
-	return ret;
+	return (lzw->bit_count >= code_size);
 }
@@ -31,6 +31,13 @@ typedef enum {
 	GIF_END_OF_FRAME = -7
 } gif_result;
 
+/*	Disposal methods of a frame (gif_frame.disposal_method)
+*/
+#define GIF_FRAME_COMBINE 1
+#define GIF_FRAME_CLEAR 2
+#define GIF_FRAME_RESTORE 3
+#define GIF_FRAME_QUIRKS_RESTORE 4
+
 /*	The GIF frame data
 */
 typedef struct gif_frame {
@@ -87,6 +94,8 @@ typedef struct gif_animation {
 	void *frame_image;				/**< currently decoded image; stored as bitmap from bitmap_create callback */
 	int loop_count;					/**< number of times to loop animation */
 	gif_result current_error;			/**< current error type, or 0 for none*/
+	bool more_data;					/**< more GIF data will follow (truncated frames are not closed) */
+	bool first_frame_reported;			/**< GIF_WORKING was returned for the first complete frame */
 	/**	Internal members are listed below
 	*/
 	unsigned int buffer_position;			/**< current index into GIF data */
@@ -100,9 +109,20 @@ typedef struct gif_animation {
 	unsigned int *local_colour_table;		/**< local colour table */
 } gif_animation;
 
+/*	Colour indices of a frame decompressed apart from plotting
+*/
+typedef struct gif_indices {
+	unsigned int frame;				/**< frame the indices belong to */
+	unsigned char *data;				/**< indices of the frame image, or NULL (release with free()) */
+	unsigned int decoded;				/**< number of indices decompressed */
+	gif_result result;				/**< result of the decompression */
+} gif_indices;
+
 void gif_create(gif_animation *gif, gif_bitmap_callback_vt *bitmap_callbacks);
 gif_result gif_initialise(gif_animation *gif, size_t size, unsigned char *data);
 gif_result gif_decode_frame(gif_animation *gif, unsigned int frame);
+gif_result gif_decode_frame_indices(gif_animation *gif, unsigned int frame, gif_indices *indices);
+gif_result gif_decode_frame_with_indices(gif_animation *gif, unsigned int frame, gif_indices *indices);
 void gif_finalise(gif_animation *gif);
 
 #endif
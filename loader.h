@@ -2,6 +2,7 @@
 
 /* for jpeg */
 #include <jpeglib.h>
+#include <jerror.h>
 
 /* for png */
 #include <png.h>
@@ -22,7 +23,12 @@ enum {
 	CHECK_HEADER_SIZE = 8,
 	BYTES_PER_PIXEL   = 4,
 	PNG_HEADER_SIZE   = 8,
-	MAX_FRAME_NUM     = 128, /* limit of gif frames */
+	INPUT_BUFSIZE     = 64 * 1024, /* initial buffer size for pipe input */
+	MAX_THREADS       = 16,  /* limit of decoding threads */
+	GIF_CHECKPOINTS   = 4,   /* composited gif frames kept for seeking */
+	GIF_CACHED_FRAMES = 2,   /* decoded gif frames kept for playback */
+	PALETTE_SIZE      = 256, /* colors of indexed frame */
+	PALETTE_HASH_SIZE = 1024, /* hash table to find palette index of color */
 };
 
 enum filetype_t {
@@ -35,20 +41,402 @@ enum filetype_t {
 	TYPE_UNKNOWN,
 };
 
+/* memory layout of image data */
+enum pixel_layout_t {
+	LAYOUT_RGB = 0, /* gray/rgb (+ alpha): 1 byte per channel (see img->channel) */
+	/* framebuffer native pixel (never has alpha): byte order in memory */
+	LAYOUT_BGRX,
+	LAYOUT_RGBX,
+	LAYOUT_XBGR,
+	LAYOUT_XRGB,
+	LAYOUT_RGB565,  /* 16bit host endian pixel */
+};
+
+struct rect_t {
+	int x, y;
+	int width, height;
+};
+
+/* one frame of image: normally only frames[0], frames[n] (n > 1) for animation gif or pages of tiff */
+struct frame_t {
+	uint8_t *data;      /* NULL until decoded if decode_frame is set: use get_frame() */
+	uint8_t *palette;   /* indexed frame: data is 1 byte index of color (NULL: data is color) */
+	struct rect_t rect; /* delta frame: rectangle of data in image */
+	int delay;
+	bool shared;        /* same pixels as the previous frame: data belongs to it (see keep_frames()) */
+};
+
 struct image_t {
-	/* normally use data[0], data[n] (n > 1) for animanion gif */
-	uint8_t *data[MAX_FRAME_NUM];
+	struct frame_t *frames; /* frame_count frames (see set_frame_count()) */
 	int width;
 	int height;
-	int channel;
+	int channel;     /* bytes per pixel */
 	bool alpha;
-	/* for animation gif */
-	int delay[MAX_FRAME_NUM];
-	int frame_count; /* normally 1 */
+	enum pixel_layout_t layout;
+	bool drawn;      /* decoded straight into external buffer: frame data is empty */
+	/* data is only a region of whole image (see load_hint_t crop):
+		position of region and size of whole image (0 means not cropped) */
+	int crop_x, crop_y;
+	int full_width, full_height;
+	/* for animation gif: frames are composited into canvas (see get_frame()),
+		data of frames[n] (n > 0) is only rectangle updated from the previous frame */
+	bool delta;
+	uint8_t *canvas;   /* whole frame composited from delta frames (see get_frame()) */
+	int canvas_frame;
+	int frame_count; /* normally 1 (0: not loaded) */
 	int loop_count;
 	int current_frame; /* for yaimgfb */
+	bool paged;        /* frames are pages of document (not animation) */
+	/* paged: rotate/resize of the current page, done again to pages decoded later
+		(page_width == 0: nothing done yet) */
+	int page_width, page_height;         /* size of page as decoded by loader */
+	int page_angle;
+	int page_max_width, page_max_height; /* 0: not resized */
+	bool page_resized_first;             /* resized before rotated */
+	/* lazy decoding: decoder state is kept until free_image() */
+	int max_cached;    /* decoded frames kept in memory (0: all) */
+	void *decoder;
+	bool (*decode_frame)(struct image_t *img, int index);
+	void (*release_decoder)(void *decoder);
+};
+
+/* whole input file in memory: every decoder reads from here
+	(regular file is mapped, pipe is read into allocated buffer) */
+struct input_t {
+	uint8_t *data;
+	size_t size;
+	size_t capacity; /* allocated size of pipe input */
+	size_t offset;   /* read position for stream style decoders (libpng/libtiff) */
+	int fd;          /* >= 0 while pipe input is still arriving */
+	bool mapped;
 };
 
+/* hints for decoders (NULL or 0 means no limit):
+	image will be shrunk to fit max_width x max_height after loading,
+	so decoders can skip the work of producing more pixels than needed */
+struct load_hint_t {
+	int max_width;
+	int max_height;
+	/* called with partially decoded image while input is arriving
+		(now progressive jpeg and the first frame of animation gif) */
+	void (*progress)(struct image_t *img, void *arg);
+	void *progress_arg;
+	/* preferred pixel layout: decoders which can't produce it
+		(or image has alpha channel) fall back to LAYOUT_RGB */
+	enum pixel_layout_t layout;
+	/* called when size of native layout image is known:
+		return first row of external buffer (e.g. framebuffer) and its stride
+		to let decoder write rows there, or NULL to decode into img->frames[0].data */
+	uint8_t *(*direct)(struct image_t *img, int *stride, void *arg);
+	void *direct_arg;
+	/* called when size of image is known: return true and visible region
+		to decode only that region (now jpeg/tiff, jpeg region may get wider) */
+	bool (*crop)(struct image_t *img, int *x, int *y, int *width, int *height, void *arg);
+	void *crop_arg;
+};
+
+/* input functions */
+bool fill_input(struct input_t *input)
+{
+	/* read next chunk of pipe input: return false at the end of input */
+	uint8_t *data;
+	size_t capacity;
+	ssize_t size;
+
+	if (input->fd < 0)
+		return false;
+
+	/* read straight into the tail of buffer, grow it when full */
+	if (input->size == input->capacity) {
+		capacity = (input->capacity == 0) ? INPUT_BUFSIZE: input->capacity * 2;
+		if ((data = (uint8_t *) erealloc(input->data, capacity)) == NULL)
+			goto fill_input_end;
+		input->data     = data;
+		input->capacity = capacity;
+	}
+
+	while ((size = read(input->fd, input->data + input->size, input->capacity - input->size)) < 0) {
+		if (errno != EINTR) {
+			logging(ERROR, "read: %s\n", strerror(errno));
+			goto fill_input_end;
+		}
+	}
+
+	if (size > 0) {
+		input->size += size;
+		return true;
+	}
+
+fill_input_end:
+	if (input->fd != STDIN_FILENO)
+		eclose(input->fd);
+	input->fd = -1;
+	return false;
+}
+
+void read_input(struct input_t *input)
+{
+	while (fill_input(input));
+}
+
+bool map_input(int fd, struct input_t *input, size_t size)
+{
+	/* private writable mapping: libnsgif patches broken data in place,
+		these writes must not reach the file */
+	input->data = (uint8_t *) emmap(0, size,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (input->data == MAP_FAILED) {
+		input->data = NULL;
+		return false;
+	}
+	input->size   = size;
+	input->mapped = true;
+
+	return true;
+}
+
+/* path == NULL: read from stdin */
+bool open_input(const char *path, struct input_t *input)
+{
+	int fd;
+	bool ret;
+	struct stat st;
+
+	input->data     = NULL;
+	input->size     = 0;
+	input->capacity = 0;
+	input->offset   = 0;
+	input->fd       = -1;
+	input->mapped   = false;
+
+	if (path == NULL)
+		fd = STDIN_FILENO;
+	else if ((fd = eopen(path, O_RDONLY)) < 0)
+		return false;
+
+	if (efstat(fd, &st) < 0) {
+		ret = false;
+	} else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		ret = map_input(fd, input, st.st_size);
+	} else {
+		/* pipe: read only file header here, the rest is read by load_image() */
+		input->fd = fd;
+		while (input->size < CHECK_HEADER_SIZE && fill_input(input));
+		if (input->size == 0)
+			logging(ERROR, "input is empty\n");
+		return (input->size > 0);
+	}
+
+	if (fd != STDIN_FILENO)
+		eclose(fd);
+
+	return ret;
+}
+
+void close_input(struct input_t *input)
+{
+	if (input->fd >= 0 && input->fd != STDIN_FILENO)
+		eclose(input->fd);
+	input->fd = -1;
+
+	if (input->mapped)
+		emunmap(input->data, input->size);
+	else
+		free(input->data);
+	input->data = NULL;
+	input->size = 0;
+}
+
+void move_input(struct input_t *dst, struct input_t *src)
+{
+	/* dst takes over input (for lazy decoding): closing src does nothing */
+	*dst = *src;
+	src->data   = NULL;
+	src->fd     = -1;
+	src->mapped = false;
+}
+
+static inline int input_getc(struct input_t *input)
+{
+	return (input->offset < input->size) ? input->data[input->offset++]: EOF;
+}
+
+bool set_frame_count(struct image_t *img, int count)
+{
+	/* frames are allocated as many as needed (new frames are empty) */
+	struct frame_t *frames;
+
+	if (count > img->frame_count) {
+		if ((frames = (struct frame_t *) erealloc(img->frames, count * sizeof(struct frame_t))) == NULL)
+			return false;
+		memset(frames + img->frame_count, 0, (count - img->frame_count) * sizeof(struct frame_t));
+		img->frames = frames;
+	}
+	img->frame_count = count;
+
+	return true;
+}
+
+/* gray + alpha or rgb + alpha (framebuffer native pixel never has alpha) */
+static inline bool has_alpha(struct image_t *img)
+{
+	return (img->layout == LAYOUT_RGB && (img->channel == 2 || img->channel == 4)) ? true: false;
+}
+
+/* buffer for decoded rows: external buffer given by hint->direct() or img->frames[0].data */
+uint8_t *get_output(struct image_t *img, struct load_hint_t *hint, int *stride)
+{
+	uint8_t *dst;
+
+	if (img->layout != LAYOUT_RGB && hint && hint->direct
+		&& (dst = hint->direct(img, stride, hint->direct_arg)) != NULL) {
+		logging(DEBUG, "decode directly into external buffer (stride:%d)\n", *stride);
+		img->drawn = true;
+		return dst;
+	}
+
+	*stride = img->width * img->channel;
+	if ((img->frames[0].data = (uint8_t *) ecalloc(img->height, *stride)) == NULL)
+		return NULL;
+
+	return img->frames[0].data;
+}
+
+/* shrink functions: box filter fed with one source row at a time,
+	decoders can shrink image without holding full size image in memory
+	(resize_image() uses the same filter) */
+struct shrink_t {
+	int src_width, src_height;
+	int dst_width, dst_height;
+	int channel;
+	int rate;       /* MULTIPLER * dst / src */
+	int src_y;      /* next source row */
+	int dst_y;      /* destination row being summed up */
+	int dst_end;    /* stop before this destination row (see shrink_split()) */
+	int *x_from;    /* source columns of each destination column: [x_from, x_to) */
+	int *x_to;
+	uint32_t *sum;  /* pixel sum of current destination row */
+	uint8_t *row;   /* buffer of one source row for decoders */
+	uint8_t *data;  /* shrunk image */
+};
+
+void shrink_die(struct shrink_t *shrink)
+{
+	/* shrink->data is not freed: it belongs to image */
+	free(shrink->x_from);
+	free(shrink->sum);
+	free(shrink->row);
+	shrink->x_from = NULL;
+	shrink->sum    = NULL;
+	shrink->row    = NULL;
+}
+
+/* return false if image fits in max_width x max_height (or no memory) */
+bool shrink_init(struct shrink_t *shrink, int width, int height, int channel, int max_width, int max_height)
+{
+	int width_rate, height_rate;
+
+	memset(shrink, 0, sizeof(struct shrink_t));
+
+	width_rate  = MULTIPLER * max_width  / width;
+	height_rate = MULTIPLER * max_height / height;
+	shrink->rate = (width_rate < height_rate) ? width_rate: height_rate;
+
+	logging(DEBUG, "width_rate:%.2d height_rate:%.2d resize_rate:%.2d\n",
+		width_rate, height_rate, shrink->rate);
+
+	/* only support shrink */
+	if ((shrink->rate / MULTIPLER) >= 1 || shrink->rate <= 0)
+		return false;
+
+	shrink->src_width  = width;
+	shrink->src_height = height;
+	shrink->channel    = channel;
+	/* rounding up the width must not exceed max_width: resize_image() would shrink it again */
+	shrink->dst_width  = shrink->rate * width / MULTIPLER + 1;
+	shrink->dst_height = shrink->rate * height / MULTIPLER;
+	if (shrink->dst_width > max_width)
+		shrink->dst_width = max_width;
+
+	if (shrink->dst_height <= 0
+		|| (shrink->x_from = (int *) ecalloc(shrink->dst_width * 2, sizeof(int))) == NULL
+		|| (shrink->sum = (uint32_t *) ecalloc(shrink->dst_width * channel, sizeof(uint32_t))) == NULL
+		|| (shrink->row = (uint8_t *) ecalloc(width, channel)) == NULL
+		|| (shrink->data = (uint8_t *) ecalloc((size_t) shrink->dst_width * shrink->dst_height, channel)) == NULL) {
+		shrink_die(shrink);
+		return false;
+	}
+	shrink->x_to = shrink->x_from + shrink->dst_width;
+	shrink->dst_end = shrink->dst_height;
+
+	for (int x = 0; x < shrink->dst_width; x++) {
+		shrink->x_from[x] = MULTIPLER * x / shrink->rate;
+		shrink->x_to[x]   = MULTIPLER * (x + 1) / shrink->rate;
+		if (shrink->x_to[x] > width)
+			shrink->x_to[x] = width;
+		if (shrink->x_from[x] >= shrink->x_to[x])
+			shrink->x_from[x] = shrink->x_to[x] - 1;
+	}
+	/* last column takes the rest of source row */
+	shrink->x_to[shrink->dst_width - 1] = width;
+
+	logging(DEBUG, "resized image: %dx%d size:%d\n",
+		shrink->dst_width, shrink->dst_height, shrink->dst_width * shrink->dst_height * channel);
+
+	return true;
+}
+
+/* part of shrink for destination rows [dst_from, dst_to): share output and column table
+	with whole, but has own sum (release by free(part->sum)). feed source rows
+	from MULTIPLER * dst_from / rate to MULTIPLER * dst_to / rate */
+bool shrink_split(struct shrink_t *part, struct shrink_t *whole, int dst_from, int dst_to)
+{
+	*part = *whole;
+	part->dst_y   = dst_from;
+	part->dst_end = dst_to;
+	part->src_y   = MULTIPLER * dst_from / whole->rate;
+	part->row     = NULL;
+
+	if ((part->sum = (uint32_t *) ecalloc(whole->dst_width * whole->channel, sizeof(uint32_t))) == NULL)
+		return false;
+
+	return true;
+}
+
+void shrink_row(struct shrink_t *shrink, const uint8_t *src)
+{
+	int x, c, cells, y_from, y_to;
+	int channel = shrink->channel;
+	uint32_t *sum;
+	uint8_t *dst;
+
+	if (shrink->dst_y >= shrink->dst_end)
+		return;
+
+	for (x = 0; x < shrink->dst_width; x++) {
+		sum = shrink->sum + x * channel;
+		for (int sx = shrink->x_from[x]; sx < shrink->x_to[x]; sx++)
+			for (c = 0; c < channel; c++)
+				sum[c] += src[sx * channel + c];
+	}
+	shrink->src_y++;
+
+	/* destination row is complete: store average */
+	y_from = MULTIPLER * shrink->dst_y / shrink->rate;
+	y_to   = MULTIPLER * (shrink->dst_y + 1) / shrink->rate;
+	if (shrink->src_y < y_to)
+		return;
+
+	dst = shrink->data + shrink->dst_y * shrink->dst_width * channel;
+	for (x = 0; x < shrink->dst_width; x++) {
+		cells = (y_to - y_from) * (shrink->x_to[x] - shrink->x_from[x]);
+		for (c = 0; c < channel; c++)
+			dst[x * channel + c] = shrink->sum[x * channel + c] / cells;
+	}
+	memset(shrink->sum, 0, shrink->dst_width * channel * sizeof(uint32_t));
+	shrink->dst_y++;
+}
+
 /* libjpeg functions */
 struct my_jpeg_error_mgr {
 	struct jpeg_error_mgr pub;
@@ -89,10 +477,195 @@ void my_jpeg_warning(j_common_ptr cinfo, int msg_level)
 	}
 }
 
-bool load_jpeg(const char *path, FILE *fp, struct image_t *img)
+/* libjpeg source manager: reads struct input_t and waits for pipe input */
+struct my_jpeg_source_mgr {
+	struct jpeg_source_mgr pub;
+	struct input_t *input;
+};
+
+void my_jpeg_init_source(j_decompress_ptr cinfo)
 {
-	int row_stride, size;
-	JSAMPARRAY buffer;
+	(void) cinfo; /* unused */
+}
+
+boolean my_jpeg_fill_input_buffer(j_decompress_ptr cinfo)
+{
+	static const JOCTET fake_eoi[] = {0xFF, JPEG_EOI};
+	struct my_jpeg_source_mgr *src = (struct my_jpeg_source_mgr *) cinfo->src;
+	struct input_t *input = src->input;
+
+	/* input->offset: end of data already passed to libjpeg */
+	if (input->offset == input->size && !fill_input(input)) {
+		/* insert fake EOI marker, libjpeg shows what we have */
+		WARNMS(cinfo, JWRN_JPEG_EOF);
+		src->pub.next_input_byte = fake_eoi;
+		src->pub.bytes_in_buffer = sizeof(fake_eoi);
+		return TRUE;
+	}
+
+	src->pub.next_input_byte = input->data + input->offset;
+	src->pub.bytes_in_buffer = input->size - input->offset;
+	input->offset = input->size;
+
+	return TRUE;
+}
+
+void my_jpeg_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+	struct jpeg_source_mgr *src = cinfo->src;
+
+	if (num_bytes <= 0)
+		return;
+
+	while (num_bytes > (long) src->bytes_in_buffer) {
+		num_bytes -= src->bytes_in_buffer;
+		(*src->fill_input_buffer)(cinfo);
+	}
+	src->next_input_byte += num_bytes;
+	src->bytes_in_buffer -= num_bytes;
+}
+
+void my_jpeg_term_source(j_decompress_ptr cinfo)
+{
+	(void) cinfo; /* unused */
+}
+
+void my_jpeg_input_src(j_decompress_ptr cinfo, struct input_t *input)
+{
+	struct my_jpeg_source_mgr *src;
+
+	src = (struct my_jpeg_source_mgr *) (*cinfo->mem->alloc_small)((j_common_ptr) cinfo,
+		JPOOL_PERMANENT, sizeof(struct my_jpeg_source_mgr));
+
+	src->pub.init_source       = my_jpeg_init_source;
+	src->pub.fill_input_buffer = my_jpeg_fill_input_buffer;
+	src->pub.skip_input_data   = my_jpeg_skip_input_data;
+	src->pub.resync_to_restart = jpeg_resync_to_restart;
+	src->pub.term_source       = my_jpeg_term_source;
+	src->pub.next_input_byte   = NULL;
+	src->pub.bytes_in_buffer   = 0;
+	src->input = input;
+
+	input->offset = 0;
+	cinfo->src = (struct jpeg_source_mgr *) src;
+}
+
+int jpeg_scale_denom(struct jpeg_decompress_struct *cinfo, struct load_hint_t *hint)
+{
+	int denom;
+
+	if (!hint || hint->max_width <= 0 || hint->max_height <= 0)
+		return 1;
+
+	/* libjpeg can decode at 1/2, 1/4 or 1/8 scale in the IDCT step:
+		choose the smallest scale that still needs shrinking by resize_image() */
+	for (denom = 8; denom > 1; denom /= 2) {
+		if ((int) cinfo->image_width / denom >= hint->max_width
+			|| (int) cinfo->image_height / denom >= hint->max_height)
+			break;
+	}
+	return denom;
+}
+
+/* choose output color space: libjpeg-turbo can write framebuffer pixel directly */
+void jpeg_set_layout(struct jpeg_decompress_struct *cinfo, struct load_hint_t *hint, struct image_t *img)
+{
+#ifdef JCS_EXTENSIONS
+	static const struct {
+		J_COLOR_SPACE color_space;
+		int bytes_per_pixel;
+	} layout_table[LAYOUT_RGB565 + 1] = {
+		[LAYOUT_RGB]    = {JCS_RGB,      3},
+		[LAYOUT_BGRX]   = {JCS_EXT_BGRX, 4},
+		[LAYOUT_RGBX]   = {JCS_EXT_RGBX, 4},
+		[LAYOUT_XBGR]   = {JCS_EXT_XBGR, 4},
+		[LAYOUT_XRGB]   = {JCS_EXT_XRGB, 4},
+#if LIBJPEG_TURBO_VERSION_NUMBER >= 1004000
+		/* JCS_RGB565 appeared in libjpeg-turbo 1.4 (empty entry: decode as rgb) */
+		[LAYOUT_RGB565] = {JCS_RGB565,   2},
+#endif
+	};
+
+	if (hint && hint->layout != LAYOUT_RGB && layout_table[hint->layout].bytes_per_pixel > 0) {
+		img->layout  = hint->layout;
+		img->channel = layout_table[hint->layout].bytes_per_pixel;
+		cinfo->out_color_space = layout_table[hint->layout].color_space;
+		/* truncate like color2pixel() instead of dithering 16bpp output */
+		cinfo->dither_mode = JDITHER_NONE;
+		return;
+	}
+#else
+	(void) hint;
+#endif
+	/* grayscale -> rgb */
+	img->layout  = LAYOUT_RGB;
+	img->channel = 3;
+	cinfo->out_color_space = JCS_RGB;
+}
+
+void jpeg_set_region(struct jpeg_decompress_struct *cinfo, struct image_t *img, int x, int y, int width, int height)
+{
+#if LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+	JDIMENSION xoffset, crop_width;
+
+	/* fancy upsampling at region edge uses neighbour pixels: add margin */
+	x--; y--;
+	width  += 2;
+	height += 2;
+
+	/* clip region by image */
+	if (x < 0)
+		x = 0;
+	if (y < 0)
+		y = 0;
+	if (width > img->width - x)
+		width = img->width - x;
+	if (height > img->height - y)
+		height = img->height - y;
+
+	if (width <= 0 || height <= 0 || (width == img->width && height == img->height))
+		return;
+
+	/* libjpeg-turbo expands horizontal region to iMCU boundary */
+	xoffset    = x;
+	crop_width = width;
+	jpeg_crop_scanline(cinfo, &xoffset, &crop_width);
+
+	img->full_width  = img->width;
+	img->full_height = img->height;
+	img->crop_x      = xoffset;
+	img->crop_y      = y;
+	img->width       = crop_width;
+	img->height      = height;
+
+	logging(DEBUG, "jpeg region: %dx%d+%d+%d (image %dx%d)\n",
+		img->width, img->height, img->crop_x, img->crop_y, img->full_width, img->full_height);
+#else
+	(void) cinfo; (void) img; (void) x; (void) y; (void) width; (void) height;
+#endif
+}
+
+void jpeg_read_image(struct jpeg_decompress_struct *cinfo, uint8_t *dst, int stride, int height)
+{
+	/* decode rec_outbuf_height rows per call straight into destination
+		(height rows from current scanline) */
+	JDIMENSION top = cinfo->output_scanline;
+	JDIMENSION left, rows = (cinfo->rec_outbuf_height < MAX_SAMP_FACTOR) ? cinfo->rec_outbuf_height: MAX_SAMP_FACTOR;
+	JSAMPROW row_pointers[MAX_SAMP_FACTOR];
+
+	while (cinfo->output_scanline - top < (JDIMENSION) height) {
+		left = height - (cinfo->output_scanline - top);
+		for (JDIMENSION i = 0; i < rows; i++)
+			row_pointers[i] = dst + (size_t) (cinfo->output_scanline - top + i) * stride;
+		jpeg_read_scanlines(cinfo, row_pointers, (rows < left) ? rows: left);
+	}
+}
+
+bool load_jpeg(const char *path, struct input_t *input, struct image_t *img, struct load_hint_t *hint)
+{
+	int stride, crop_x, crop_y, crop_width, crop_height;
+	bool final_pass;
+	uint8_t *dst;
 	struct jpeg_decompress_struct cinfo;
 	struct my_jpeg_error_mgr jerr;
 
@@ -105,38 +678,69 @@ bool load_jpeg(const char *path, FILE *fp, struct image_t *img)
 
 	if (setjmp(jerr.setjmp_buffer)) {
 		jpeg_destroy_decompress(&cinfo);
+		free(img->frames[0].data);
+		img->frames[0].data = NULL;
 		return false;
 	}
 
 	jpeg_create_decompress(&cinfo);
-	jpeg_stdio_src(&cinfo, fp);
+	my_jpeg_input_src(&cinfo, input);
 	jpeg_read_header(&cinfo, TRUE);
 
-	/* disable colormap (indexed color), grayscale -> rgb */
+	/* disable colormap (indexed color) */
 	cinfo.quantize_colors = FALSE;
-	cinfo.out_color_space = JCS_RGB;
+	jpeg_set_layout(&cinfo, hint, img);
+
+	/* reduce image size while decoding */
+	cinfo.scale_num   = 1;
+	cinfo.scale_denom = jpeg_scale_denom(&cinfo, hint);
+	logging(DEBUG, "jpeg scale: 1/%d\n", cinfo.scale_denom);
+
+	/* show each scan of progressive jpeg while pipe input is arriving */
+	cinfo.buffered_image = (hint && hint->progress && input->fd >= 0
+		&& jpeg_has_multiple_scans(&cinfo)) ? TRUE: FALSE;
+
 	jpeg_start_decompress(&cinfo);
 
 	img->width   = cinfo.output_width;
 	img->height  = cinfo.output_height;
-	img->channel = cinfo.output_components;
 
-	size = img->width * img->height * img->channel;
-	if ((img->data[0] = (uint8_t *) ecalloc(1, size)) == NULL) {
-		jpeg_finish_decompress(&cinfo);
+	/* decode only visible region: skip other iMCU columns and rows */
+	if (!cinfo.buffered_image && hint && hint->crop
+		&& hint->crop(img, &crop_x, &crop_y, &crop_width, &crop_height, hint->crop_arg))
+		jpeg_set_region(&cinfo, img, crop_x, crop_y, crop_width, crop_height);
+
+	if ((dst = get_output(img, hint, &stride)) == NULL) {
 		jpeg_destroy_decompress(&cinfo);
 		return false;
 	}
 
-	row_stride = cinfo.output_width * cinfo.output_components;
-	buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
-
-	while (cinfo.output_scanline < cinfo.output_height) {
-		jpeg_read_scanlines(&cinfo, buffer, 1);
-		memcpy(img->data[0] + (cinfo.output_scanline - 1) * row_stride, buffer[0], row_stride);
+	if (cinfo.buffered_image) {
+		/* output pass decodes the latest scan, reading input until it completes */
+		do {
+			final_pass = jpeg_input_complete(&cinfo);
+			jpeg_start_output(&cinfo, cinfo.input_scan_number);
+			jpeg_read_image(&cinfo, dst, stride, img->height);
+			jpeg_finish_output(&cinfo);
+			/* image drawn directly is already visible */
+			if (!final_pass && !img->drawn) {
+				logging(DEBUG, "jpeg scan:%d\n", cinfo.output_scan_number);
+				hint->progress(img, hint->progress_arg);
+			}
+		} while (!final_pass);
+	} else {
+#if LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+		if (img->crop_y > 0)
+			jpeg_skip_scanlines(&cinfo, img->crop_y);
+#endif
+		jpeg_read_image(&cinfo, dst, stride, img->height);
 	}
 
-	jpeg_finish_decompress(&cinfo);
+	/* rows below region are never decoded */
+	if (cinfo.output_scanline < cinfo.output_height)
+		jpeg_abort_decompress(&cinfo);
+	else
+		jpeg_finish_decompress(&cinfo);
 	jpeg_destroy_decompress(&cinfo);
 
 	return true;
@@ -156,21 +760,62 @@ void my_png_warning(png_structp png_ptr, png_const_charp warning_msg)
 	logging(WARN, "libpng: %s\n", warning_msg);
 }
 
-bool load_png(const char *path, FILE *fp, struct image_t *img)
+void my_png_read(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	struct input_t *input = (struct input_t *) png_get_io_ptr(png_ptr);
+
+	if (length > input->size - input->offset)
+		png_error(png_ptr, "unexpected end of data");
+
+	memcpy(data, input->data + input->offset, length);
+	input->offset += length;
+}
+
+/* opaque image: let libpng add filler byte (and swap red/blue) for framebuffer
+	(libpng has no 16bpp output) */
+void png_set_layout(png_structp png_ptr, png_infop info_ptr, struct load_hint_t *hint, struct image_t *img)
 {
-	int row_stride, size;
-	png_bytep *row_pointers = NULL;
-	unsigned char header[PNG_HEADER_SIZE];
+	enum pixel_layout_t layout = hint ? hint->layout: LAYOUT_RGB;
+
+	img->layout = LAYOUT_RGB;
+
+	if ((png_get_color_type(png_ptr, info_ptr) & PNG_COLOR_MASK_ALPHA)
+		|| png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+		return;
+
+	switch (layout) {
+	case LAYOUT_BGRX:
+	case LAYOUT_XBGR:
+		png_set_bgr(png_ptr);
+		break;
+	case LAYOUT_RGBX:
+	case LAYOUT_XRGB:
+		break;
+	default:
+		return;
+	}
+	png_set_filler(png_ptr, 0xFF,
+		(layout == LAYOUT_BGRX || layout == LAYOUT_RGBX) ? PNG_FILLER_AFTER: PNG_FILLER_BEFORE);
+	img->layout = layout;
+}
+
+bool load_png(const char *path, struct input_t *input, struct image_t *img, struct load_hint_t *hint)
+{
+	int stride, passes;
+	bool shrinking;
+	uint8_t *dst;
+	struct shrink_t shrink;
 	png_structp png_ptr;
 	png_infop info_ptr;
 
 	(void) path;
 
-	if (fread(header, 1, PNG_HEADER_SIZE, fp) != PNG_HEADER_SIZE)
+	if (input->size < PNG_HEADER_SIZE)
 		return false;
 
-	if (png_sig_cmp(header, 0, PNG_HEADER_SIZE))
+	if (png_sig_cmp(input->data, 0, PNG_HEADER_SIZE))
 		return false;
+	input->offset = PNG_HEADER_SIZE;
 
 	if ((png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, my_png_error, my_png_warning)) == NULL)
 		return false;
@@ -180,116 +825,619 @@ bool load_png(const char *path, FILE *fp, struct image_t *img)
 		return false;
 	}
 
+	memset(&shrink, 0, sizeof(struct shrink_t));
+
 	if (setjmp(png_jmpbuf(png_ptr))) {
+		shrink_die(&shrink);
+		free(shrink.data);
+		free(img->frames[0].data);
+		img->frames[0].data = NULL;
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 		return false;
 	}
 
-	png_init_io(png_ptr, fp);
+	png_set_read_fn(png_ptr, input, my_png_read);
 	png_set_sig_bytes(png_ptr, PNG_HEADER_SIZE);
-	/* force 3 bytes per pixel image
-		(-	strip alpha)
-		-	6 bytes per pixel -> 3 bytes per pixel
-		-	1,2,4 bits per color -> 8 bits per color
-		-	grayscale -> rgb
-		-	perform set_expand() */
-	png_read_png(png_ptr, info_ptr,
-		PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING
-		| PNG_TRANSFORM_GRAY_TO_RGB | PNG_TRANSFORM_EXPAND, NULL);
-		//PNG_TRANSFORM_STRIP_ALPHA
+	png_read_info(png_ptr, info_ptr);
 
-	//png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_PACKING, NULL);
+	/* force 8 bits per color image
+		-	16 bits per color -> 8 bits per color
+		-	1,2,4 bits per color -> 8 bits per color
+		-	palette/low bit depth gray/tRNS -> rgb/gray (+ alpha)
+		-	grayscale -> rgb */
+	png_set_strip_16(png_ptr);
+	png_set_packing(png_ptr);
+	png_set_expand(png_ptr);
+	png_set_gray_to_rgb(png_ptr);
+	png_set_layout(png_ptr, info_ptr, hint, img);
+	passes = png_set_interlace_handling(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
 
 	img->width   = png_get_image_width(png_ptr, info_ptr);
 	img->height  = png_get_image_height(png_ptr, info_ptr);
 	img->channel = png_get_channels(png_ptr, info_ptr);
 
-	size = img->width * img->height * img->channel;
-	if ((img->data[0] = (uint8_t *) ecalloc(1, size)) == NULL) {
-		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-		return false;
-	}
+	/* non-interlaced image can be shrunk row by row:
+		full size image is never allocated */
+	shrinking = (passes == 1 && hint && hint->max_width > 0 && hint->max_height > 0
+		&& shrink_init(&shrink, img->width, img->height, img->channel, hint->max_width, hint->max_height));
 
-	row_stride   = png_get_rowbytes(png_ptr, info_ptr);
-	row_pointers = png_get_rows(png_ptr, info_ptr);
+	if (shrinking) {
+		for (int y = 0; y < img->height; y++) {
+			png_read_row(png_ptr, shrink.row, NULL);
+			shrink_row(&shrink, shrink.row);
+		}
+	} else {
+		if ((dst = get_output(img, hint, &stride)) == NULL) {
+			png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+			return false;
+		}
 
-	for (int i = 0; i < img->height; i++)
-		memcpy(img->data[0] + row_stride * i, row_pointers[i], row_stride);
+		/* decode rows straight into destination (interlaced image: each pass updates rows) */
+		for (int pass = 0; pass < passes; pass++)
+			for (int y = 0; y < img->height; y++)
+				png_read_row(png_ptr, dst + (size_t) y * stride, NULL);
+	}
 
+	png_read_end(png_ptr, NULL);
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
+	if (shrinking) {
+		shrink_die(&shrink);
+		img->frames[0].data = shrink.data;
+		img->width   = shrink.dst_width;
+		img->height  = shrink.dst_height;
+	}
+
 	return true;
 }
 
 /* libtiff functions */
-bool load_tiff(const char *path, FILE *fp, struct image_t *img)
+tmsize_t my_tiff_read(thandle_t handle, void *buf, tmsize_t size)
 {
-    TIFF *tiff;
-	/*
-	uint16_t bps, type, planar, orient;
-	uint32_t rps;
-	*/
-	int size;
+	struct input_t *input = (struct input_t *) handle;
+
+	if ((size_t) size > input->size - input->offset)
+		size = input->size - input->offset;
+
+	memcpy(buf, input->data + input->offset, size);
+	input->offset += size;
+
+	return size;
+}
+
+tmsize_t my_tiff_write(thandle_t handle, void *buf, tmsize_t size)
+{
+	(void) handle; /* unused */
+	(void) buf;
+	(void) size;
+	return -1; /* read only */
+}
 
-	(void) fp;
+toff_t my_tiff_seek(thandle_t handle, toff_t offset, int whence)
+{
+	struct input_t *input = (struct input_t *) handle;
+
+	if (whence == SEEK_CUR)
+		offset += input->offset;
+	else if (whence == SEEK_END)
+		offset += input->size;
+
+	input->offset = (offset < input->size) ? offset: input->size;
+	return offset;
+}
+
+int my_tiff_close(thandle_t handle)
+{
+	(void) handle; /* input is released by load_image() (or free_image() for lazy pages) */
+	return 0;
+}
+
+toff_t my_tiff_size(thandle_t handle)
+{
+	return ((struct input_t *) handle)->size;
+}
+
+int my_tiff_map(thandle_t handle, void **base, toff_t *size)
+{
+	struct input_t *input = (struct input_t *) handle;
+
+	/* libtiff reads strips/tiles directly from our mapping */
+	*base = input->data;
+	*size = input->size;
+	return 1;
+}
+
+void my_tiff_unmap(thandle_t handle, void *base, toff_t size)
+{
+	(void) handle; /* unused */
+	(void) base;
+	(void) size;
+}
+
+/* one band of tiff image: a strip or a row of tiles
+	(only one band is in memory while decoding) */
+struct tiff_band_t {
+	uint32_t width, height;            /* image size */
+	uint32_t tile_width, tile_height;  /* strip: width x rows per strip */
+	bool tiled;
+	uint32_t x_from, x_to;             /* needed columns: tiles outside are skipped */
+	uint32_t *raster;                  /* one strip/tile from TIFFReadRGBA{Strip,Tile}() */
+	uint8_t *data;                     /* band rows of tiles (RGBA, top to bottom) */
+};
+
+static inline uint8_t *tiff_band_row(struct tiff_band_t *band, uint32_t r, uint32_t rows)
+{
+	/* TIFFReadRGBA{Strip,Tile}() returns raster upside down (origin is lower left):
+		strip rows are used in place */
+	if (!band->tiled)
+		return (uint8_t *) (band->raster + (size_t) (rows - 1 - r) * band->width);
+	return band->data + (size_t) r * band->width * BYTES_PER_PIXEL;
+}
+
+bool tiff_read_band(TIFF *tiff, struct tiff_band_t *band, uint32_t top, uint32_t rows)
+{
+	uint32_t x, cols;
+	size_t row_stride = (size_t) band->width * BYTES_PER_PIXEL;
+
+	if (!band->tiled)
+		return TIFFReadRGBAStrip(tiff, top, band->raster);
+
+	/* gather row of tiles (partial tile is placed at lower left of tile raster) */
+	for (x = band->x_from - band->x_from % band->tile_width; x < band->x_to; x += band->tile_width) {
+		if (!TIFFReadRGBATile(tiff, x, top, band->raster))
+			return false;
+		cols = (band->tile_width < band->width - x) ? band->tile_width: band->width - x;
+		for (uint32_t r = 0; r < rows; r++)
+			memcpy(band->data + r * row_stride + (size_t) x * BYTES_PER_PIXEL,
+				band->raster + (size_t) (band->tile_height - 1 - r) * band->tile_width, (size_t) cols * BYTES_PER_PIXEL);
+	}
+	return true;
+}
 
-    if ((tiff = TIFFOpen(path, "r")) == NULL)
+bool tiff_band_init(struct tiff_band_t *band)
+{
+	band->raster = NULL;
+	band->data   = NULL;
+
+	if ((band->raster = (uint32_t *) ecalloc((size_t) band->tile_width * band->tile_height, sizeof(uint32_t))) == NULL
+		|| (band->tiled && (band->data = (uint8_t *) ecalloc((size_t) band->width * band->tile_height, BYTES_PER_PIXEL)) == NULL))
 		return false;
 
-    if (!TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &img->width)
-        || !TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &img->height))
-		/*
-        || !TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &img->channel)
-        || !TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &bps)
-        || !TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &type)
-        || !TIFFGetField(tiff, TIFFTAG_PLANARCONFIG, &planar)
-        || !TIFFGetField(tiff, TIFFTAG_ROWSPERSTRIP, &rps)
-        || !TIFFGetField(tiff, TIFFTAG_ORIENTATION, &orient))
-		*/
-        return false;
-
-    logging(DEBUG, "width:%d height:%d\n", img->width, img->height);
-		
-	/*
-	logging(DEBUG, "bps:%d type:%d planar:%d rps:%d orient:%d\n",
-		bps, type, planar, rps, orient);
-	*/
-	
-	img->channel = 4; /* because TIFFReadRGBAImage() converts image channel == 4 */
-	size = img->width * img->height * img->channel;
-	if ((img->data[0] = (uint8_t *) ecalloc(1, size)) == NULL
-		|| !TIFFReadRGBAImageOriented(tiff, img->width, img->height, (uint32_t *) img->data[0], ORIENTATION_TOPLEFT, 0)) {
-		TIFFClose(tiff);
+	return true;
+}
+
+void tiff_band_die(struct tiff_band_t *band)
+{
+	free(band->raster);
+	free(band->data);
+}
+
+/* how pages of tiff are decoded: the first page decides, later pages do the same
+	(pages are decoded lazily, so decoder keeps whole input) */
+struct tiff_decoder_t {
+	char name[BUFSIZE];
+	struct input_t input;
+	int max_width, max_height;        /* shrink to fit (0: no shrink) */
+	int crop_x, crop_y;               /* decode only region (crop_width == 0: whole page) */
+	int crop_width, crop_height;
+	int *dirs;                        /* tiff directory of each frame */
+};
+
+/* strips/tiles are compressed independently: each worker decodes source rows [top, bottom)
+	with own libtiff handle (own read position over shared input) and own band */
+struct tiff_worker_t {
+	pthread_t thread;
+	const char *path;
+	struct input_t input;
+	TIFF *tiff;              /* NULL: worker opens own handle */
+	int dir;                 /* directory (page) to decode */
+	struct tiff_band_t band;
+	bool shrinking;
+	struct shrink_t shrink;  /* part of shrink (see shrink_split()) */
+	struct image_t *img;
+	uint32_t top, bottom;
+	bool ok;
+};
+
+bool tiff_decode_rows(struct tiff_worker_t *worker)
+{
+	struct tiff_band_t *band = &worker->band;
+	struct image_t *img = worker->img;
+	uint32_t top, rows, y;
+	uint8_t *src;
+
+	for (top = worker->top - worker->top % band->tile_height; top < worker->bottom; top += band->tile_height) {
+		rows = (band->tile_height < band->height - top) ? band->tile_height: band->height - top;
+		if (!tiff_read_band(worker->tiff, band, top, rows))
+			return false;
+
+		for (uint32_t r = 0; r < rows; r++) {
+			y = top + r;
+			if (y < worker->top || y >= worker->bottom)
+				continue;
+
+			src = tiff_band_row(band, r, rows);
+			if (worker->shrinking)
+				shrink_row(&worker->shrink, src);
+			else /* whole image or region (img->crop_{x,y} == 0 for whole image) */
+				memcpy(img->frames[0].data + (size_t) (y - img->crop_y) * img->width * img->channel,
+					src + (size_t) img->crop_x * BYTES_PER_PIXEL, (size_t) img->width * img->channel);
+		}
+	}
+	return true;
+}
+
+void *tiff_worker(void *arg)
+{
+	struct tiff_worker_t *worker = (struct tiff_worker_t *) arg;
+
+	worker->input.offset = 0;
+	if ((worker->tiff = TIFFClientOpen(worker->path, "r", (thandle_t) &worker->input,
+		my_tiff_read, my_tiff_write, my_tiff_seek, my_tiff_close,
+		my_tiff_size, my_tiff_map, my_tiff_unmap)) == NULL) {
+		worker->ok = false;
+		return NULL;
+	}
+
+	worker->ok = (worker->dir == 0 || TIFFSetDirectory(worker->tiff, worker->dir))
+		&& tiff_decode_rows(worker);
+	TIFFClose(worker->tiff);
+
+	return NULL;
+}
+
+int tiff_worker_count(uint32_t bands)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* thread is worth starting for 2 bands or more */
+	if (cpus > MAX_THREADS)
+		cpus = MAX_THREADS;
+	if (cpus > (long) bands / 2)
+		cpus = bands / 2;
+
+	return (cpus > 1) ? cpus: 1;
+}
+
+/* decode current directory of tiff into img->frames[0].data
+	(hint is only passed for the first page: region is asked once) */
+bool tiff_read_page(struct tiff_decoder_t *decoder, struct input_t *input, TIFF *tiff,
+	int dir, struct image_t *img, struct load_hint_t *hint)
+{
+	uint16_t orientation;
+	uint32_t width, height, rows_per_strip, row_from, row_to, band_from, bands;
+	int crop_x = 0, crop_y = 0, crop_width, crop_height, nworkers = 0, dst_from, dst_to;
+	bool shrinking = false, ok = true;
+	uint8_t *region;
+	struct shrink_t shrink;
+	struct tiff_band_t band;
+	struct tiff_worker_t *workers = NULL, *worker;
+
+	if (!TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width)
+		|| !TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height)
+		|| width == 0 || height == 0 || width > INT_MAX / BYTES_PER_PIXEL || height > INT_MAX)
 		return false;
+	TIFFGetFieldDefaulted(tiff, TIFFTAG_ORIENTATION, &orientation);
+
+	logging(DEBUG, "page:%d width:%u height:%u orientation:%u tiled:%s\n",
+		dir, width, height, orientation, TIFFIsTiled(tiff) ? "true": "false");
+
+	img->width   = width;
+	img->height  = height;
+	img->channel = BYTES_PER_PIXEL; /* because TIFFReadRGBA*() converts image channel == 4 */
+
+	/* strips/tiles can't be decoded one by one if image is flipped:
+		decode whole image at once, then shrink/crop it like other pages */
+	if (orientation != ORIENTATION_TOPLEFT) {
+		if ((img->frames[0].data = (uint8_t *) ecalloc((size_t) width * height, BYTES_PER_PIXEL)) == NULL
+			|| !TIFFReadRGBAImageOriented(tiff, width, height, (uint32_t *) img->frames[0].data, ORIENTATION_TOPLEFT, 0))
+			goto tiff_error;
+
+		if (decoder->max_width > 0 && decoder->max_height > 0
+			&& shrink_init(&shrink, img->width, img->height, img->channel, decoder->max_width, decoder->max_height)) {
+			for (int y = 0; y < img->height; y++)
+				shrink_row(&shrink, img->frames[0].data + (size_t) y * img->width * img->channel);
+			shrink_die(&shrink);
+			free(img->frames[0].data);
+			img->frames[0].data = shrink.data;
+			img->width  = shrink.dst_width;
+			img->height = shrink.dst_height;
+		} else if (decoder->crop_width > 0) {
+			if ((region = (uint8_t *) ecalloc((size_t) decoder->crop_width * decoder->crop_height, img->channel)) == NULL)
+				goto tiff_error;
+			for (int y = 0; y < decoder->crop_height; y++)
+				memcpy(region + (size_t) y * decoder->crop_width * img->channel,
+					img->frames[0].data + ((size_t) (decoder->crop_y + y) * img->width + decoder->crop_x) * img->channel,
+					(size_t) decoder->crop_width * img->channel);
+			free(img->frames[0].data);
+			img->frames[0].data = region;
+			img->full_width  = img->width;
+			img->full_height = img->height;
+			img->crop_x      = decoder->crop_x;
+			img->crop_y      = decoder->crop_y;
+			img->width       = decoder->crop_width;
+			img->height      = decoder->crop_height;
+		}
+		return true;
+	}
+
+	band.width  = width;
+	band.height = height;
+	band.tiled  = TIFFIsTiled(tiff);
+	if (band.tiled) {
+		TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &band.tile_width);
+		TIFFGetField(tiff, TIFFTAG_TILELENGTH, &band.tile_height);
+	} else {
+		TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+		band.tile_width  = width;
+		band.tile_height = (rows_per_strip < height) ? rows_per_strip: height;
+	}
+	if (band.tile_width == 0 || band.tile_height == 0)
+		goto tiff_error;
+	band.x_from = 0;
+	band.x_to   = width;
+
+	/* output: shrunk image, visible region or whole image
+		(full size image is never allocated for the first two) */
+	if (decoder->max_width > 0 && decoder->max_height > 0)
+		shrinking = shrink_init(&shrink, img->width, img->height, img->channel, decoder->max_width, decoder->max_height);
+
+	if (!shrinking && hint && hint->crop
+		&& hint->crop(img, &crop_x, &crop_y, &crop_width, &crop_height, hint->crop_arg)) {
+		if (crop_x < 0)
+			crop_x = 0;
+		if (crop_y < 0)
+			crop_y = 0;
+		if (crop_width > img->width - crop_x)
+			crop_width = img->width - crop_x;
+		if (crop_height > img->height - crop_y)
+			crop_height = img->height - crop_y;
+		if (crop_width > 0 && crop_height > 0
+			&& (crop_width < img->width || crop_height < img->height)) {
+			decoder->crop_x      = crop_x;
+			decoder->crop_y      = crop_y;
+			decoder->crop_width  = crop_width;
+			decoder->crop_height = crop_height;
+		}
+	}
+
+	if (!shrinking && decoder->crop_width > 0) {
+		img->full_width  = img->width;
+		img->full_height = img->height;
+		img->crop_x      = decoder->crop_x;
+		img->crop_y      = decoder->crop_y;
+		img->width       = decoder->crop_width;
+		img->height      = decoder->crop_height;
+		band.x_from      = img->crop_x;
+		band.x_to        = img->crop_x + img->width;
+		logging(DEBUG, "tiff region: %dx%d+%d+%d\n", img->width, img->height, img->crop_x, img->crop_y);
+	}
+
+	if (!shrinking && (img->frames[0].data = (uint8_t *) ecalloc((size_t) img->width * img->height, img->channel)) == NULL)
+		goto tiff_error;
+
+	/* split needed rows among workers by band */
+	row_from  = img->crop_y;
+	row_to    = img->crop_y + (shrinking ? height: (uint32_t) img->height);
+	band_from = row_from / band.tile_height;
+	bands     = (row_to + band.tile_height - 1) / band.tile_height - band_from;
+	nworkers  = tiff_worker_count(bands);
+	if (shrinking && nworkers > shrink.dst_height)
+		nworkers = shrink.dst_height;
+
+	if ((workers = (struct tiff_worker_t *) ecalloc(nworkers, sizeof(struct tiff_worker_t))) == NULL) {
+		nworkers = 0;
+		goto tiff_error;
+	}
+	logging(DEBUG, "tiff bands:%u workers:%d\n", bands, nworkers);
+
+	for (int i = 0; i < nworkers; i++) {
+		worker = &workers[i];
+		worker->path      = decoder->name;
+		worker->input     = *input;
+		worker->tiff      = (nworkers == 1) ? tiff: NULL;
+		worker->dir       = dir;
+		worker->band      = band;
+		worker->shrinking = shrinking;
+		worker->img       = img;
+
+		if (shrinking) {
+			/* each worker shrinks its own destination rows
+				(band on the border is decoded by both workers) */
+			dst_from       = shrink.dst_height * i / nworkers;
+			dst_to         = shrink.dst_height * (i + 1) / nworkers;
+			worker->top    = MULTIPLER * dst_from / shrink.rate;
+			worker->bottom = MULTIPLER * dst_to / shrink.rate;
+			if (!shrink_split(&worker->shrink, &shrink, dst_from, dst_to))
+				ok = false;
+		} else {
+			worker->top    = (band_from + bands * i / nworkers) * band.tile_height;
+			worker->bottom = (band_from + bands * (i + 1) / nworkers) * band.tile_height;
+			if (worker->top < row_from)
+				worker->top = row_from;
+			if (worker->bottom > row_to)
+				worker->bottom = row_to;
+		}
+
+		if (!tiff_band_init(&worker->band))
+			ok = false;
+	}
+	if (!ok)
+		goto tiff_error;
+
+	/* decode band by band, and shrink/crop each band */
+	if (nworkers == 1) {
+		ok = tiff_decode_rows(&workers[0]);
+	} else {
+		for (int i = 0; i < nworkers; i++)
+			if (pthread_create(&workers[i].thread, NULL, tiff_worker, &workers[i]) != 0) {
+				workers[i].thread = pthread_self();
+				tiff_worker(&workers[i]);
+			}
+		for (int i = 0; i < nworkers; i++) {
+			if (!pthread_equal(workers[i].thread, pthread_self()))
+				pthread_join(workers[i].thread, NULL);
+			ok = ok && workers[i].ok;
+		}
+	}
+	if (!ok)
+		goto tiff_error;
+
+	for (int i = 0; i < nworkers; i++) {
+		tiff_band_die(&workers[i].band);
+		if (shrinking)
+			free(workers[i].shrink.sum);
+	}
+	free(workers);
+
+	if (shrinking) {
+		shrink_die(&shrink);
+		img->frames[0].data = shrink.data;
+		img->width   = shrink.dst_width;
+		img->height  = shrink.dst_height;
+	}
+
+	return true;
+
+tiff_error:
+	for (int i = 0; i < nworkers; i++) {
+		tiff_band_die(&workers[i].band);
+		if (shrinking)
+			free(workers[i].shrink.sum);
 	}
+	free(workers);
+	if (shrinking) {
+		shrink_die(&shrink);
+		free(shrink.data);
+	}
+	free(img->frames[0].data);
+	img->frames[0].data = NULL;
+	return false;
+}
 
+TIFF *tiff_open(const char *name, struct input_t *input)
+{
+	input->offset = 0;
+	return TIFFClientOpen(name, "r", (thandle_t) input,
+		my_tiff_read, my_tiff_write, my_tiff_seek, my_tiff_close,
+		my_tiff_size, my_tiff_map, my_tiff_unmap);
+}
+
+bool tiff_decode_frame(struct image_t *img, int index)
+{
+	/* decode page on first access: same size, shrink and region as the first page
+		(get_frame_data() rotates/resizes it like the current page) */
+	struct tiff_decoder_t *decoder = (struct tiff_decoder_t *) img->decoder;
+	struct image_t page;
+	struct frame_t frame;
+	TIFF *tiff;
+	int width  = (img->page_width) ? img->page_width: img->width;
+	int height = (img->page_width) ? img->page_height: img->height;
+	bool ok;
+
+	memset(&page, 0, sizeof(struct image_t));
+	memset(&frame, 0, sizeof(struct frame_t));
+	page.frames      = &frame;
+	page.frame_count = 1;
+
+	if ((tiff = tiff_open(decoder->name, &decoder->input)) == NULL)
+		return false;
+	ok = TIFFSetDirectory(tiff, decoder->dirs[index])
+		&& tiff_read_page(decoder, &decoder->input, tiff, decoder->dirs[index], &page, NULL);
 	TIFFClose(tiff);
 
-    return true;
+	if (!ok)
+		return false;
+
+	/* frames share size */
+	if (page.width != width || page.height != height) {
+		logging(ERROR, "tiff page %d: %dx%d doesn't match image %dx%d\n",
+			decoder->dirs[index], page.width, page.height, width, height);
+		free(frame.data);
+		return false;
+	}
+	img->frames[index].data = frame.data;
+
+	return true;
 }
 
-/* libns{gif,bmp} functions */
-unsigned char *file_into_memory(FILE *fp, size_t *data_size)
+void tiff_release_decoder(void *decoder)
 {
-	unsigned char *buffer;
-	size_t n, size;
+	struct tiff_decoder_t *tiff_decoder = (struct tiff_decoder_t *) decoder;
 
-	fseek(fp, 0L, SEEK_END);
-	size = ftell(fp);
+	close_input(&tiff_decoder->input);
+	free(tiff_decoder->dirs);
+	free(tiff_decoder);
+}
 
-	if ((buffer = ecalloc(1, size)) == NULL)
-		return NULL;
+bool load_tiff(const char *path, struct input_t *input, struct image_t *img, struct load_hint_t *hint)
+{
+	TIFF *tiff;
+	uint32_t width, height;
+	struct tiff_decoder_t *decoder;
+	int dir, *dirs;
 
-	fseek(fp, 0L, SEEK_SET);
-	if ((n = fread(buffer, 1, size, fp)) != size) {
-		free(buffer);
-		return NULL;
+	if ((decoder = (struct tiff_decoder_t *) ecalloc(1, sizeof(struct tiff_decoder_t))) == NULL)
+		return false;
+	decoder->input.fd = -1;
+	snprintf(decoder->name, BUFSIZE, "%s", path);
+	if (hint) {
+		decoder->max_width  = hint->max_width;
+		decoder->max_height = hint->max_height;
 	}
-	*data_size = size;
 
-	return buffer;
+	if ((decoder->dirs = (int *) ecalloc(1, sizeof(int))) == NULL
+		|| (tiff = tiff_open(path, input)) == NULL) {
+		tiff_release_decoder(decoder);
+		return false;
+	}
+
+	if (!tiff_read_page(decoder, input, tiff, 0, img, hint)) {
+		TIFFClose(tiff);
+		tiff_release_decoder(decoder);
+		return false;
+	}
+	TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+	TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+
+	/* every page (directory) of the same size is a frame:
+		other pages (e.g. thumbnail) can't share struct image_t */
+	for (dir = 1; TIFFReadDirectory(tiff); dir++) {
+		uint32_t w = 0, h = 0;
+
+		TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &w);
+		TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &h);
+		if (w != width || h != height) {
+			logging(WARN, "tiff page %d: size %ux%u differs from first page, skipped\n", dir, w, h);
+			continue;
+		}
+		if ((dirs = (int *) erealloc(decoder->dirs, (img->frame_count + 1) * sizeof(int))) == NULL)
+			break;
+		decoder->dirs = dirs;
+		if (!set_frame_count(img, img->frame_count + 1))
+			break;
+		decoder->dirs[img->frame_count - 1] = dir;
+	}
+	TIFFClose(tiff);
+
+	if (img->frame_count == 1) {
+		tiff_release_decoder(decoder);
+		return true;
+	}
+
+	/* decoder owns input from now on: load_image() has nothing to close */
+	move_input(&decoder->input, input);
+
+	img->paged           = true;
+	img->decoder         = decoder;
+	img->decode_frame    = tiff_decode_frame;
+	img->release_decoder = tiff_release_decoder;
+
+	return true;
 }
 
+/* libns{gif,bmp} functions */
 void *gif_bitmap_create(int width, int height)
 {
 	return calloc(width * height, BYTES_PER_PIXEL);
@@ -323,7 +1471,311 @@ void gif_bitmap_modified(void *bitmap)
 	return;
 }
 
-bool load_gif(const char *path, FILE *fp, struct image_t *img)
+/* frames of gif are composited one after another (see disposal method):
+	canvas is kept at some frames to seek without replaying from the first frame */
+struct gif_decoder_t {
+	struct input_t input;     /* gif.gif_data points here */
+	gif_animation gif;
+	int current;              /* frame composited in gif.frame_image (-1: none) */
+	int interval;             /* checkpoint is taken every interval frames */
+	uint8_t *checkpoints[GIF_CHECKPOINTS];
+	int nworkers;             /* frames decompressed at once (1: by gif_decode_frame()) */
+	gif_indices ahead[MAX_THREADS]; /* frames decompressed ahead of compositing */
+	int nahead;               /* entries of ahead holding the current batch */
+};
+
+/* LZW data of frames are independent: each worker decompresses one frame into indices,
+	then frames are composited one after another (see gif_decode_frame_lazy()) */
+struct gif_worker_t {
+	pthread_t thread;
+	gif_animation *gif;
+	gif_indices *indices;
+	unsigned int frame;
+};
+
+void *gif_worker(void *arg)
+{
+	struct gif_worker_t *worker = (struct gif_worker_t *) arg;
+
+	gif_decode_frame_indices(worker->gif, worker->frame, worker->indices);
+
+	return NULL;
+}
+
+int gif_worker_count(int frames)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* thread is worth starting for 2 frames or more */
+	if (cpus > MAX_THREADS)
+		cpus = MAX_THREADS;
+	if (cpus > (long) frames / 2)
+		cpus = frames / 2;
+
+	return (cpus > 1) ? cpus: 1;
+}
+
+void gif_release_ahead(struct gif_decoder_t *decoder)
+{
+	for (int i = 0; i < decoder->nworkers; i++) {
+		free(decoder->ahead[i].data);
+		decoder->ahead[i].data = NULL;
+	}
+	decoder->nahead = 0;
+}
+
+gif_indices *gif_frame_ahead(struct gif_decoder_t *decoder, int frame)
+{
+	/* indices of frame: decompress it with following frames in parallel if not done yet
+		(NULL: gif_decode_frame() decompresses it) */
+	struct gif_worker_t workers[MAX_THREADS];
+	int nworkers = 0;
+
+	/* a frame not displayed has nothing to decompress and is left out of batches,
+		a 0x0 frame matches its entry without data: neither starts a new batch */
+	if (decoder->nworkers == 1 || !decoder->gif.frames[frame].display)
+		return NULL;
+
+	for (int i = 0; i < decoder->nahead; i++)
+		if (decoder->ahead[i].frame == (unsigned int) frame)
+			return &decoder->ahead[i];
+
+	gif_release_ahead(decoder);
+	for (int next = frame; nworkers < decoder->nworkers && next < (int) decoder->gif.frame_count; next++) {
+		if (!decoder->gif.frames[next].display)
+			continue;
+		workers[nworkers].gif     = &decoder->gif;
+		workers[nworkers].indices = &decoder->ahead[nworkers];
+		workers[nworkers].frame   = next;
+		if (pthread_create(&workers[nworkers].thread, NULL, gif_worker, &workers[nworkers]) != 0) {
+			workers[nworkers].thread = pthread_self();
+			gif_worker(&workers[nworkers]);
+		}
+		nworkers++;
+	}
+	for (int i = 0; i < nworkers; i++)
+		if (!pthread_equal(workers[i].thread, pthread_self()))
+			pthread_join(workers[i].thread, NULL);
+	decoder->nahead = nworkers;
+
+	return &decoder->ahead[0];
+}
+
+void gif_grow_rect(gif_animation *gif, int frame, int *x_from, int *y_from, int *x_to, int *y_to)
+{
+	gif_frame *f = &gif->frames[frame];
+
+	if (*x_from > (int) f->redraw_x)
+		*x_from = f->redraw_x;
+	if (*y_from > (int) f->redraw_y)
+		*y_from = f->redraw_y;
+	if (*x_to < (int) (f->redraw_x + f->redraw_width))
+		*x_to = f->redraw_x + f->redraw_width;
+	if (*y_to < (int) (f->redraw_y + f->redraw_height))
+		*y_to = f->redraw_y + f->redraw_height;
+}
+
+void gif_update_rect(gif_animation *gif, int frame, struct rect_t *rect)
+{
+	/* canvas area libnsgif changes when it decodes this frame after the previous one:
+		this frame and the previous frame if it is cleared. "restore previous" decodes
+		the last undisposed frame again, which changes the same area of that frame
+		(it may clear or restore again, and the first frame clears whole canvas) */
+	int x_from = INT_MAX, y_from = INT_MAX, x_to = 0, y_to = 0;
+	int prev, last;
+
+	while (gif->frames[frame].display) {
+		gif_grow_rect(gif, frame, &x_from, &y_from, &x_to, &y_to);
+		if (frame == 0) {
+			x_from = y_from = 0;
+			x_to = y_to = INT_MAX;
+			break;
+		}
+
+		prev = frame - 1;
+		if (gif->frames[prev].disposal_method == GIF_FRAME_CLEAR) {
+			if (gif->frames[prev].display)
+				gif_grow_rect(gif, prev, &x_from, &y_from, &x_to, &y_to);
+			break;
+		} else if (gif->frames[prev].disposal_method != GIF_FRAME_RESTORE) {
+			break;
+		}
+
+		for (last = prev - 1; last >= 0 && gif->frames[last].disposal_method == GIF_FRAME_RESTORE; last--)
+			;
+		if (last < 0) {
+			x_from = y_from = 0;
+			x_to = y_to = INT_MAX;
+			break;
+		}
+		frame = last;
+	}
+
+	if (x_to > (int) gif->width)
+		x_to = gif->width;
+	if (y_to > (int) gif->height)
+		y_to = gif->height;
+
+	/* empty update: one pixel keeps copying simple */
+	if (x_from >= x_to || y_from >= y_to) {
+		x_from = y_from = 0;
+		x_to = y_to = 1;
+	}
+
+	rect->x      = x_from;
+	rect->y      = y_from;
+	rect->width  = x_to - x_from;
+	rect->height = y_to - y_from;
+}
+
+bool gif_index_rect(uint8_t *dst, uint8_t *palette, uint8_t *canvas, size_t stride, struct rect_t *rect)
+{
+	/* colors of rectangle to palette index: false if rectangle has too many colors
+		(frames composited with different local color tables) */
+	uint32_t keys[PALETTE_HASH_SIZE], color, last = 0;
+	int16_t values[PALETTE_HASH_SIZE];
+	int colors = 0, last_index = -1, h;
+	uint8_t *src;
+
+	for (h = 0; h < PALETTE_HASH_SIZE; h++)
+		values[h] = -1;
+
+	for (int y = 0; y < rect->height; y++) {
+		src = canvas + (rect->y + y) * stride + rect->x * BYTES_PER_PIXEL;
+		for (int x = 0; x < rect->width; x++, src += BYTES_PER_PIXEL) {
+			memcpy(&color, src, BYTES_PER_PIXEL);
+			if (last_index < 0 || color != last) {
+				h = (color * 2654435761U) % PALETTE_HASH_SIZE;
+				while (values[h] >= 0 && keys[h] != color)
+					h = (h + 1) % PALETTE_HASH_SIZE;
+				if (values[h] < 0) {
+					if (colors == PALETTE_SIZE)
+						return false;
+					keys[h]   = color;
+					values[h] = colors;
+					memcpy(palette + colors * BYTES_PER_PIXEL, src, BYTES_PER_PIXEL);
+					colors++;
+				}
+				last       = color;
+				last_index = values[h];
+			}
+			*dst++ = last_index;
+		}
+	}
+	return true;
+}
+
+bool gif_decode_frame_lazy(struct image_t *img, int index)
+{
+	struct gif_decoder_t *decoder = (struct gif_decoder_t *) img->decoder;
+	gif_animation *gif = &decoder->gif;
+	size_t size = (size_t) img->width * img->height * img->channel;
+	size_t stride = (size_t) img->width * img->channel;
+	int point = index / decoder->interval;
+	struct rect_t *rect = &img->frames[index].rect;
+	uint8_t *canvas;
+	gif_result code;
+
+	/* continue from current frame, or restart from the nearest checkpoint */
+	while (point >= 0 && decoder->checkpoints[point] == NULL)
+		point--;
+
+	if (decoder->current < 0 || decoder->current > index
+		|| (point >= 0 && decoder->current < point * decoder->interval)) {
+		if (point >= 0) {
+			memcpy(gif_bitmap_get_buffer(gif->frame_image), decoder->checkpoints[point], size);
+			decoder->current   = point * decoder->interval;
+			gif->decoded_frame = decoder->current;
+		} else {
+			decoder->current   = -1;
+			gif->decoded_frame = -1; /* GIF_INVALID_FRAME: frame 0 clears canvas */
+		}
+	}
+
+	while (decoder->current < index) {
+		decoder->current++;
+		if ((code = gif_decode_frame_with_indices(gif, decoder->current,
+			gif_frame_ahead(decoder, decoder->current))) != GIF_OK) {
+			logging(ERROR, "gif_decode_frame() failed: frame:%d code:%d\n", decoder->current, code);
+			decoder->current = -1;
+			return false;
+		}
+
+		point = decoder->current / decoder->interval;
+		if (decoder->current % decoder->interval == 0 && decoder->checkpoints[point] == NULL
+			&& (decoder->checkpoints[point] = (uint8_t *) ecalloc(1, size)) != NULL)
+			memcpy(decoder->checkpoints[point], gif_bitmap_get_buffer(gif->frame_image), size);
+	}
+
+	/* keep only updated rectangle of canvas: palette index if possible */
+	canvas = gif_bitmap_get_buffer(gif->frame_image);
+	if ((img->frames[index].palette = (uint8_t *) ecalloc(PALETTE_SIZE, img->channel)) != NULL
+		&& (img->frames[index].data = (uint8_t *) ecalloc((size_t) rect->width * rect->height, 1)) != NULL
+		&& gif_index_rect(img->frames[index].data, img->frames[index].palette, canvas, stride, rect))
+		return true;
+
+	free(img->frames[index].palette);
+	free(img->frames[index].data);
+	img->frames[index].palette = NULL;
+
+	if ((img->frames[index].data = (uint8_t *) ecalloc((size_t) rect->width * rect->height, img->channel)) == NULL)
+		return false;
+
+	for (int y = 0; y < rect->height; y++)
+		memcpy(img->frames[index].data + (size_t) y * rect->width * img->channel,
+			canvas + (rect->y + y) * stride + rect->x * img->channel, (size_t) rect->width * img->channel);
+
+	return true;
+}
+
+void gif_release_decoder(void *decoder)
+{
+	struct gif_decoder_t *gif_decoder = (struct gif_decoder_t *) decoder;
+
+	for (int i = 0; i < GIF_CHECKPOINTS; i++)
+		free(gif_decoder->checkpoints[i]);
+	gif_release_ahead(gif_decoder);
+	gif_finalise(&gif_decoder->gif);
+	close_input(&gif_decoder->input);
+	free(gif_decoder);
+}
+
+gif_result gif_scan_input(gif_animation *gif, struct input_t *input)
+{
+	/* find frames of gif, reading more pipe input while a frame is incomplete
+		(GIF_WORKING: only the first frame is found yet, call again for the rest) */
+	gif_result code;
+	bool more_data;
+
+	while (true) {
+		more_data      = (input->fd >= 0);
+		gif->more_data = more_data;
+		code = gif_initialise(gif, input->size, input->data);
+		if ((code != GIF_INSUFFICIENT_DATA && code != GIF_INSUFFICIENT_FRAME_DATA) || !more_data)
+			return code;
+		/* the end of pipe input is scanned again as the end of gif */
+		fill_input(input);
+	}
+}
+
+void gif_show_first_frame(gif_animation *gif, struct image_t *img, struct load_hint_t *hint)
+{
+	/* show the first frame while the following frames are arriving */
+	if (gif_decode_frame(gif, 0) != GIF_OK)
+		return;
+
+	img->width          = gif->width;
+	img->height         = gif->height;
+	img->channel        = BYTES_PER_PIXEL;
+	img->layout         = LAYOUT_RGB;
+	img->alpha          = has_alpha(img);
+	img->frames[0].data = gif_bitmap_get_buffer(gif->frame_image);
+	hint->progress(img, hint->progress_arg);
+	img->frames[0].data = NULL;
+	img->alpha          = false;
+}
+
+bool load_gif(const char *path, struct input_t *input, struct image_t *img, struct load_hint_t *hint)
 {
 	gif_bitmap_callback_vt gif_callbacks = {
 		gif_bitmap_create,
@@ -333,56 +1785,83 @@ bool load_gif(const char *path, FILE *fp, struct image_t *img)
 		gif_bitmap_test_opaque,
 		gif_bitmap_modified
 	};
-	size_t size;
 	gif_result code;
-	unsigned char *mem;
-	gif_animation gif;
-	int i;
+	struct gif_decoder_t *decoder;
+	gif_animation *gif;
 
 	(void) path;
 
-	gif_create(&gif, &gif_callbacks);
-	if ((mem = file_into_memory(fp, &size)) == NULL)
+	if ((decoder = (struct gif_decoder_t *) ecalloc(1, sizeof(struct gif_decoder_t))) == NULL)
 		return false;
-
-	code = gif_initialise(&gif, size, mem);
-	if (code != GIF_OK && code != GIF_WORKING)
+	gif = &decoder->gif;
+	decoder->input.fd = -1;
+	decoder->current  = -1;
+
+	gif_create(gif, &gif_callbacks);
+
+	/* the first frame is found before the rest of pipe input arrives */
+	code = gif_scan_input(gif, input);
+	if (code == GIF_WORKING && input->fd >= 0 && hint && hint->progress)
+		gif_show_first_frame(gif, img, hint);
+	while (code == GIF_WORKING)
+		code = gif_scan_input(gif, input);
+
+	/* frames before truncated data are shown */
+	if (code != GIF_OK && !((code == GIF_INSUFFICIENT_DATA || code == GIF_INSUFFICIENT_FRAME_DATA)
+		&& gif->frame_count > 0))
 		goto error_initialize_failed;
 
-	img->width   = gif.width;
-	img->height  = gif.height;
+	img->width   = gif->width;
+	img->height  = gif->height;
 	img->channel = BYTES_PER_PIXEL; /* libnsgif always return 4bpp image */
-	size = img->width * img->height * img->channel;
 
 	/* read animation gif */
-	img->frame_count = (gif.frame_count < MAX_FRAME_NUM) ? gif.frame_count: MAX_FRAME_NUM - 1;
-	img->loop_count = gif.loop_count;
-
-	for (i = 0; i < img->frame_count; i++) {
-		code = gif_decode_frame(&gif, i);
-		if (code != GIF_OK)
-			goto error_decode_failed;
+	img->loop_count = gif->loop_count;
+	if (gif->frame_count == 0 || !set_frame_count(img, gif->frame_count))
+		goto error_initialize_failed;
 
-		if ((img->data[i] = (uint8_t *) ecalloc(1, size)) == NULL)
-			goto error_decode_failed;
-		memcpy(img->data[i], gif.frame_image, size);
+	/* frames after the first are stored as rectangles updated from the previous frame */
+	img->frames[0].rect.x      = img->frames[0].rect.y = 0;
+	img->frames[0].rect.width  = img->width;
+	img->frames[0].rect.height = img->height;
+	for (int i = 0; i < img->frame_count; i++) {
+		img->frames[i].delay = gif->frames[i].frame_delay;
+		if (i > 0)
+			gif_update_rect(gif, i, &img->frames[i].rect);
+	}
+	img->delta = true;
+
+	/* frames are decoded on demand while playing:
+		only the first frame is decoded here */
+	decoder->interval = (img->frame_count + GIF_CHECKPOINTS - 1) / GIF_CHECKPOINTS;
+	decoder->nworkers = gif_worker_count(img->frame_count);
+	img->decoder = decoder;
+	if (!gif_decode_frame_lazy(img, 0)) {
+		img->decoder = NULL;
+		goto error_decode_failed;
+	}
 
-		img->delay[i] = gif.frames[i].frame_delay;
+	if (img->frame_count == 1) {
+		img->decoder = NULL;
+		gif_release_decoder(decoder);
+		return true;
 	}
 
-	gif_finalise(&gif);
-	free(mem);
+	/* decoder owns input from now on: load_image() has nothing to close */
+	move_input(&decoder->input, input);
+	img->max_cached      = GIF_CACHED_FRAMES;
+	img->decode_frame    = gif_decode_frame_lazy;
+	img->release_decoder = gif_release_decoder;
+
 	return true;
 
 error_decode_failed:
-	img->frame_count = i;
-	for (i = 0; i < img->frame_count; i++) {
-		free(img->data[i]);
-		img->data[i] = NULL;
-	}
-	gif_finalise(&gif);
+	for (int i = 0; i < GIF_CHECKPOINTS; i++)
+		free(decoder->checkpoints[i]);
+	gif_release_ahead(decoder);
 error_initialize_failed:
-	free(mem);
+	gif_finalise(gif);
+	free(decoder);
 	return false;
 }
 
@@ -408,7 +1887,7 @@ size_t bmp_bitmap_get_bpp(void *bitmap)
 	return BYTES_PER_PIXEL;
 }
 
-bool load_bmp(const char *path, FILE *fp, struct image_t *img)
+bool load_bmp(const char *path, struct input_t *input, struct image_t *img, struct load_hint_t *hint)
 {
 	bmp_bitmap_callback_vt bmp_callbacks = {
 		bmp_bitmap_create,
@@ -417,17 +1896,14 @@ bool load_bmp(const char *path, FILE *fp, struct image_t *img)
 		bmp_bitmap_get_bpp
 	};
 	bmp_result code;
-	size_t size;
-	unsigned char *mem;
 	bmp_image bmp;
 
 	(void) path;
+	(void) hint;
 
 	bmp_create(&bmp, &bmp_callbacks);
-	if ((mem = file_into_memory(fp, &size)) == NULL)
-		return false;
 
-	code = bmp_analyse(&bmp, size, mem);
+	code = bmp_analyse(&bmp, input->size, input->data);
 	if (code != BMP_OK)
 		goto error_analyse_failed;
 
@@ -439,34 +1915,31 @@ bool load_bmp(const char *path, FILE *fp, struct image_t *img)
 	img->height  = bmp.height;
 	img->channel = BYTES_PER_PIXEL; /* libnsbmp always return 4bpp image */
 
-	size = img->width * img->height * img->channel;
-	if ((img->data[0] = (uint8_t *) ecalloc(1, size)) == NULL)
-		goto error_decode_failed;
-	memcpy(img->data[0], bmp.bitmap, size);
+	/* bitmap is allocated by bmp_bitmap_create(): image takes it over */
+	img->frames[0].data = (uint8_t *) bmp.bitmap;
+	bmp.bitmap = NULL;
 
 	bmp_finalise(&bmp);
-	free(mem);
 	return true;
 
 error_decode_failed:
-	bmp_finalise(&bmp);
 error_analyse_failed:
-	free(mem);
+	bmp_finalise(&bmp);
 	return false;
 }
 
 /* pnm functions */
-int getint(FILE *fp)
+int getint(struct input_t *input)
 {
 	int c, n = 0;
 
 	do {
-		c = fgetc(fp);
+		c = input_getc(input);
 	} while (isspace(c));
 
 	while (isdigit(c)) {
 		n = n * 10 + c - '0';
-		c = fgetc(fp);
+		c = input_getc(input);
 	}
 	return n;
 }
@@ -479,16 +1952,18 @@ uint8_t pnm_normalize(int c, int type, int max_value)
 		return 0xFF * c / max_value;
 }
 
-bool load_pnm(const char *path, FILE *fp, struct image_t *img)
+bool load_pnm(const char *path, struct input_t *input, struct image_t *img, struct load_hint_t *hint)
 {
 	int size, type, c, count, max_value = 0;
 
 	(void) path;
+	(void) hint;
 
-	if (fgetc(fp) != 'P')
+	input->offset = 0;
+	if (input_getc(input) != 'P')
 		return false;
 
-	type = fgetc(fp) - '0';
+	type = input_getc(input) - '0';
 	img->channel = (type == 1 || type == 2 || type == 4 || type == 5) ? 1:
 		(type == 3 || type == 6) ? 3: -1;
 
@@ -496,52 +1971,52 @@ bool load_pnm(const char *path, FILE *fp, struct image_t *img)
 		return false;
 
 	/* read header */
-	while ((c = fgetc(fp)) != EOF) {
+	while ((c = input_getc(input)) != EOF) {
 		if (c == '#')
-			while ((c = fgetc(fp)) != '\n');
+			while ((c = input_getc(input)) != '\n' && c != EOF);
 		
 		if (isspace(c))
 			continue;
 
 		if (isdigit(c)) {
-			ungetc(c, fp);
-			img->width  = getint(fp);
-			img->height = getint(fp);
+			input->offset--; /* ungetc */
+			img->width  = getint(input);
+			img->height = getint(input);
 			if (type != 1 && type != 4)
-				max_value = getint(fp);
+				max_value = getint(input);
 			break;
 		}
 	}
 
 	size = img->width * img->height * img->channel;
-	if ((img->data[0] = ecalloc(1, size)) == NULL)
+	if ((img->frames[0].data = ecalloc(1, size)) == NULL)
 		return false;
 
 	/* read data */
 	count = 0;
 	if (1 <= type && type <= 3) {
-		while ((c = fgetc(fp)) != EOF) {
+		while (count < size && (c = input_getc(input)) != EOF) {
 			if (c == '#')
-				while ((c = fgetc(fp)) != '\n');
+				while ((c = input_getc(input)) != '\n' && c != EOF);
 			
 			if (isspace(c))
 				continue;
 
 			if (isdigit(c)) {
-				ungetc(c, fp);
-				*(img->data[0] + count++) = pnm_normalize(getint(fp), type, max_value);
+				input->offset--; /* ungetc */
+				*(img->frames[0].data + count++) = pnm_normalize(getint(input), type, max_value);
 			}
 		}
 	}
 	else {
-		while ((c = fgetc(fp)) != EOF)
-			*(img->data[0] + count++) = pnm_normalize(c, type, max_value);
+		while (count < size && (c = input_getc(input)) != EOF)
+			*(img->frames[0].data + count++) = pnm_normalize(c, type, max_value);
 	}
 
 	return true;
 }
 
-enum filetype_t check_filetype(FILE *fp)
+enum filetype_t check_filetype(struct input_t *input)
 {
 	/*
 		JPEG(JFIF): FF D8
@@ -550,7 +2025,7 @@ enum filetype_t check_filetype(FILE *fp)
 		BMP       : 42 4D (ASCII 'B' 'M')
 		PNM       : 50 [31|32|33|34|35|36] ('P' ['1' - '6'])
 	*/
-	uint8_t header[CHECK_HEADER_SIZE];
+	uint8_t *header;
 	static uint8_t jpeg_header[] = {0xFF, 0xD8};
 	static uint8_t png_header[]  = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
 	/* little endian and big endian: BigTiff not supported */
@@ -558,13 +2033,12 @@ enum filetype_t check_filetype(FILE *fp)
 		tiff_header2[] = {0x4D, 0x4D, 0x00, 0x2A}; 
 	static uint8_t gif_header[]  = {0x47, 0x49, 0x46};
 	static uint8_t bmp_header[]  = {0x42, 0x4D};
-	size_t size;
 
-	if ((size = fread(header, 1, CHECK_HEADER_SIZE, fp)) != CHECK_HEADER_SIZE) {
+	if (input->size < CHECK_HEADER_SIZE) {
 		logging(ERROR, "couldn't read header\n");
 		return TYPE_UNKNOWN;
 	}
-	fseek(fp, 0L, SEEK_SET);
+	header = input->data;
 
 	if (memcmp(header, jpeg_header, 2) == 0)
 		return TYPE_JPEG;
@@ -584,38 +2058,67 @@ enum filetype_t check_filetype(FILE *fp)
 
 void init_image(struct image_t *img)
 {
-	for (int i = 0; i < MAX_FRAME_NUM; i++) {
-		img->data[i] = NULL;
-		img->delay[i] = 0;
-	}
+	img->frames  = NULL;
 	img->width   = 0;
 	img->height  = 0;
 	img->channel = 0;
 	img->alpha   = false;
+	img->layout  = LAYOUT_RGB;
+	img->drawn   = false;
+	img->crop_x      = img->crop_y      = 0;
+	img->full_width  = img->full_height = 0;
 
 	/* for animation gif */
-	img->frame_count   = 1;
+	img->delta         = false;
+	img->canvas        = NULL;
+	img->canvas_frame  = -1;
+	img->frame_count   = 0;
 	img->loop_count    = 0;
 	img->current_frame = 0;
+	img->paged         = false;
+	img->page_width         = img->page_height     = 0;
+	img->page_angle         = 0;
+	img->page_max_width     = img->page_max_height = 0;
+	img->page_resized_first = false;
+
+	img->max_cached      = 0;
+	img->decoder         = NULL;
+	img->decode_frame    = NULL;
+	img->release_decoder = NULL;
 }
 
 void free_image(struct image_t *img)
 {
 	for (int i = 0; i < img->frame_count; i++) {
-		free(img->data[i]);
-		img->data[i] = NULL;
+		if (img->frames[i].shared)
+			continue;
+		free(img->frames[i].data);
+		free(img->frames[i].palette);
 	}
+	free(img->frames);
+	img->frames      = NULL;
+	img->frame_count = 0;
+	free(img->canvas);
+	img->canvas = NULL;
+
+	if (img->release_decoder)
+		img->release_decoder(img->decoder);
+	img->decoder         = NULL;
+	img->decode_frame    = NULL;
+	img->release_decoder = NULL;
 }
 
-bool load_image(const char *path, struct image_t *img)
+/* path == NULL: read from stdin */
+bool load_image(const char *path, struct image_t *img, struct load_hint_t *hint)
 {
 	int i;
 	enum filetype_t type;
-	FILE *fp;
+	struct input_t input;
+	const char *name = (path) ? path: "stdin";
 
 	init_image(img);
 
-	static bool (*loader[])(const char *path, FILE *fp, struct image_t *img) = {
+	static bool (*loader[])(const char *path, struct input_t *input, struct image_t *img, struct load_hint_t *hint) = {
 		[TYPE_JPEG] = load_jpeg,
 		[TYPE_PNG]  = load_png,
 		[TYPE_TIFF] = load_tiff,
@@ -624,29 +2127,37 @@ bool load_image(const char *path, struct image_t *img)
 		[TYPE_PNM]  = load_pnm,
 	};
 
-	if ((fp = efopen(path, "r")) == NULL)
+	if (!open_input(path, &input))
 		return false;
- 
-	if ((type = check_filetype(fp)) == TYPE_UNKNOWN) {
-		logging(ERROR, "unknown file type: %s\n", path);
+
+	if (!set_frame_count(img, 1))
+		goto image_load_error;
+
+	if ((type = check_filetype(&input)) == TYPE_UNKNOWN) {
+		logging(ERROR, "unknown file type: %s\n", name);
 		goto image_load_error;
 	}
 
-	if (loader[type](path, fp, img)) {
-		img->alpha = (img->channel == 2 || img->channel == 4) ? true: false;
+	/* only libjpeg/libnsgif can decode while pipe input is arriving */
+	if (type != TYPE_JPEG && type != TYPE_GIF)
+		read_input(&input);
+
+	if (loader[type](name, &input, img, hint)) {
+		img->alpha = has_alpha(img);
 		logging(DEBUG, "image width:%d height:%d channel:%d alpha:%s\n",
 			img->width, img->height, img->channel, (img->alpha) ? "true": "false");
 		if (img->frame_count > 1) {
 			logging(DEBUG, "frame:%d loop:%d\n", img->frame_count, img->loop_count);
 			for (i = 0; i < img->frame_count; i++)
-				logging(DEBUG, "delay[%u]:%u\n", i, img->delay[i]);
+				logging(DEBUG, "delay[%u]:%u\n", i, img->frames[i].delay);
 		}
-		efclose(fp);
+		close_input(&input);
 		return true;
 	}
 
 image_load_error:
-	logging(ERROR, "image load error: %s\n", path);
-	efclose(fp);
+	logging(ERROR, "image load error: %s\n", name);
+	free_image(img);
+	close_input(&input);
 	return false;
 }
@@ -106,6 +106,17 @@ void *ecalloc(size_t nmemb, size_t size)
 	return ptr;
 }
 
+void *erealloc(void *ptr, size_t size)
+{
+	void *new;
+	errno = 0;
+
+	if ((new = realloc(ptr, size)) == NULL)
+		logging(ERROR, "realloc: %s\n", strerror(errno));
+
+	return new;
+}
+
 long int estrtol(const char *nptr, char **endptr, int base)
 {
 	long int ret;
@@ -131,6 +142,17 @@ int estat(const char *restrict path, struct stat *restrict buf)
 	return ret;
 }
 
+int efstat(int fd, struct stat *buf)
+{
+	int ret;
+	errno = 0;
+
+	if ((ret = fstat(fd, buf)) < 0)
+		logging(ERROR, "fstat: %s\n", strerror(errno));
+
+	return ret;
+}
+
 int emkstemp(char *template)
 {
 	int ret;
@@ -6,11 +6,49 @@
 #include "../image.h"
 #include "parsearg.h"
 
+struct viewport_t {
+	int width, height;     /* display size of image */
+	int shift_x, shift_y;
+	int view_w, view_h;
+};
+
+bool w3m_crop(struct image_t *img, int *x, int *y, int *width, int *height, void *arg)
+{
+	/* image is displayed in original size: decode only viewport */
+	struct viewport_t *vp = (struct viewport_t *) arg;
+
+	if (img->width != vp->width || img->height != vp->height)
+		return false;
+
+	*x      = vp->shift_x;
+	*y      = vp->shift_y;
+	*width  = vp->view_w ? vp->view_w: vp->width;
+	*height = vp->view_h ? vp->view_h: vp->height;
+
+	return true;
+}
+
+bool w3m_in_region(struct image_t *img, struct viewport_t *vp)
+{
+	/* check viewport of redraw is inside of decoded region */
+	int view_w = vp->view_w ? vp->view_w: vp->width;
+	int view_h = vp->view_h ? vp->view_h: vp->height;
+
+	if (get_full_width(img) == get_image_width(img) && get_full_height(img) == get_image_height(img))
+		return true; /* whole image */
+
+	return vp->shift_x >= get_crop_x(img) && vp->shift_y >= get_crop_y(img)
+		&& vp->shift_x + view_w <= get_crop_x(img) + get_image_width(img)
+		&& vp->shift_y + view_h <= get_crop_y(img) + get_image_height(img);
+}
+
 void w3m_draw(struct framebuffer_t *fb, struct image_t imgs[], struct parm_t *parm, uint8_t alpha_background, int op)
 {
 	int index, offset_x, offset_y, width, height, shift_x, shift_y, view_w, view_h;
 	char *file;
 	struct image_t *img;
+	struct load_hint_t hint;
+	struct viewport_t vp;
 
 	logging(DEBUG, "w3m_%s()\n", (op == W3M_DRAW) ? "draw": "redraw");
 
@@ -37,12 +75,33 @@ void w3m_draw(struct framebuffer_t *fb, struct image_t imgs[], struct parm_t *pa
 	logging(DEBUG, "index:%d offset_x:%d offset_y:%d shift_x:%d shift_y:%d view_w:%d view_h:%d\n",
 		index, offset_x, offset_y, shift_x, shift_y, view_w, view_h);
 
-	if (op == W3M_DRAW) {
+	vp.width   = width;
+	vp.height  = height;
+	vp.shift_x = shift_x;
+	vp.shift_y = shift_y;
+	vp.view_w  = view_w;
+	vp.view_h  = view_h;
+
+	/* image decoded partially: reload if viewport moved outside of it */
+	if (op == W3M_DRAW || (get_current_frame(img) && !w3m_in_region(img, &vp))) {
 		if (get_current_frame(img)) { /* cleanup preloaded image */
 			free_image(img);
 			init_image(img);
 		}
-		if (load_image(file, img) == false)
+		hint.max_width    = width;
+		hint.max_height   = height;
+		hint.progress     = NULL;
+		hint.progress_arg = NULL;
+		/* image may be resized later: packed 16bpp pixel can't be averaged */
+		hint.layout       = get_pixel_layout(&fb->info);
+		if (hint.layout == LAYOUT_RGB565)
+			hint.layout = LAYOUT_RGB;
+		/* image is redrawn later: keep it in memory */
+		hint.direct       = NULL;
+		hint.direct_arg   = NULL;
+		hint.crop         = w3m_crop;
+		hint.crop_arg     = &vp;
+		if (load_image(file, img, &hint) == false)
 			return;
 	}
 
@@ -50,13 +109,16 @@ void w3m_draw(struct framebuffer_t *fb, struct image_t imgs[], struct parm_t *pa
 		logging(ERROR, "specify unloaded image? img[%d] is NULL\n", index);
 		return;
 	}
-	increment_frame(img);
+	/* pages of document stay at the current page (only it is decoded) */
+	if (!is_paged(img))
+		increment_frame(img);
 
 	/* XXX: maybe need to resize at this time */
-	if (width != get_image_width(img) || height != get_image_height(img))
-		resize_image(img, width, height, true);
+	if (width != get_full_width(img) || height != get_full_height(img))
+		resize_image(img, width, height, !is_paged(img));
 
-	draw_image(fb, img, offset_x, offset_y, shift_x, shift_y,
+	/* shift in decoded region */
+	draw_image(fb, img, offset_x, offset_y, shift_x - get_crop_x(img), shift_y - get_crop_y(img),
 		(view_w ? view_w: width), (view_h ? view_h: height), alpha_background, false);
 }
 
@@ -85,7 +147,8 @@ void w3m_getsize(struct image_t *img, const char *file)
 		init_image(img);
 	}
 
-	if (load_image(file, img))
+	/* w3m needs original image size: no hint */
+	if (load_image(file, img, NULL))
 		printf("%d %d\n", get_image_width(img), get_image_height(img));
 	else
 		printf("0 0\n");